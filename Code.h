@@ -1,534 +1,3546 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <istream>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+// Iterator dereference policy for front-ends that expose only their keys.
+template<class T>
+struct KeyAccess {
+    using value_type = T;
+
+    template<bool Const>
+    using reference = const T &;
+
+    template<bool Const>
+    using pointer = const T *;
+
+    template<bool Const, class Leaf>
+    static reference<Const> get(Leaf *leaf, size_t index) {
+        return leaf->keys[index];
+    }
+
+    template<bool Const, class Leaf>
+    static pointer<Const> arrow(Leaf *leaf, size_t index) {
+        return &(leaf->keys[index]);
+    }
+};
+
+// Iterator dereference policy for Map: every entry is a pair<const K, V> in its own box, which
+// the leaf keeps next to the copy of the key it searches by, so iterators hand out real
+// references to value_type.
+template<class K, class V>
+struct EntryAccess {
+    using value_type = std::pair<const K, V>;
+
+    template<bool Const>
+    using reference = typename std::conditional<Const, const value_type &, value_type &>::type;
+
+    template<bool Const>
+    using pointer = typename std::conditional<Const, const value_type *, value_type *>::type;
+
+    template<bool Const, class Leaf>
+    static reference<Const> get(Leaf *leaf, size_t index) {
+        return leaf->value(index);
+    }
+
+    template<bool Const, class Leaf>
+    static pointer<Const> arrow(Leaf *leaf, size_t index) {
+        return &leaf->value(index);
+    }
+};
+
+// Default codec for Set::serialize / Set::deserialize: a key is stored as its raw object
+// representation. Types that are not trivially copyable need a codec of their own with the same
+// two static members.
+template<class T>
+struct BinaryCodec {
+    static_assert(std::is_trivially_copyable<T>::value, "BinaryCodec needs a trivially copyable type");
+
+    static void write(std::ostream &out, const T &key) {
+        out.write(reinterpret_cast<const char *>(&key), sizeof(T));
+    }
+
+    static bool read(std::istream &in, T &key) {
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(&key), sizeof(T)));
+    }
+};
+
+// Replaces the file at path crash-safely: the new contents go to path + ".tmp" through a file
+// descriptor, and commit syncs them, renames the file over path and syncs the directory, so after
+// a crash path holds either its old contents or all of the new ones. A file that is never
+// committed is removed. Readers that have the old file open or mapped keep seeing it intact.
+class DurableFile {
+
+private:
+    static std::string directory_of(const std::string &path) {
+        size_t slash = path.rfind('/');
+        if (slash == std::string::npos) {
+            return ".";
+        }
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    void fail() {
+        throw std::runtime_error(what_ + ": cannot write " + path_);
+    }
+
+    std::string path_, temporary_, what_;
+    int fd_;
+
+public:
+    // what names the operation in error messages.
+    DurableFile(const std::string &path, const std::string &what)
+            : path_(path), temporary_(path + ".tmp"), what_(what) {
+        fd_ = open(temporary_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            fail();
+        }
+    }
+
+    DurableFile(const DurableFile &) = delete;
+
+    DurableFile &operator=(const DurableFile &) = delete;
+
+    ~DurableFile() {
+        if (fd_ >= 0) {
+            close(fd_);
+            unlink(temporary_.c_str());
+        }
+    }
+
+    void write(const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd_, data, size);
+            if (written < 0) {
+                fail();
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    void write(const std::string &bytes) {
+        write(bytes.data(), bytes.size());
+    }
+
+    void commit() {
+        if (fsync(fd_) != 0) {
+            fail();
+        }
+        int fd = fd_;
+        fd_ = -1;
+        if (close(fd) != 0 || std::rename(temporary_.c_str(), path_.c_str()) != 0) {
+            unlink(temporary_.c_str());
+            fail();
+        }
+        if (!sync_directory(path_)) {
+            fail();
+        }
+    }
+
+    // Syncs the directory holding path, which makes a file created or renamed there durable.
+    // Returns whether it succeeded.
+    static bool sync_directory(const std::string &path) {
+        int directory = open(directory_of(path).c_str(), O_RDONLY | O_DIRECTORY);
+        if (directory < 0) {
+            return false;
+        }
+        int synced = fsync(directory);
+        close(directory);
+        return synced == 0;
+    }
+};
+
+// Number of keys in a sorted leaf that are less than key, which is the index key belongs at.
+// Every key is compared and the outcomes are summed, so the scan never branches on them.
 template<class T>
-class Set {
+struct LeafScan {
+    static size_t count_less(const T *keys, size_t count, const T &key) {
+        size_t index = 0;
+        for (size_t i = 0; i < count; ++i) {
+            index += keys[i] < key;
+        }
+        return index;
+    }
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+// On x86, leaves of int32_t, int64_t, float and double compare a whole vector of keys against key
+// and count the set bits of the resulting mask. Kernels are compiled for AVX-512, AVX2 and SSE4.2
+// side by side; the first scan picks the widest one the CPU supports, and keys past the last full
+// vector are counted one at a time. Loads are unaligned, since leaves live in a std::vector.
+template<class T, class Kernels>
+struct VectorLeafScan {
+    using Kernel = size_t (*)(const T *, size_t, T);
+
+    static size_t count_less(const T *keys, size_t count, const T &key) {
+        static const Kernel kernel = select();
+        return kernel(keys, count, key);
+    }
+
+    static Kernel select() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return &Kernels::avx512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return &Kernels::avx2;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            return &Kernels::sse;
+        }
+        return &scalar;
+    }
+
+    static size_t scalar(const T *keys, size_t count, T key) {
+        return tail(keys, 0, count, key);
+    }
+
+    static size_t tail(const T *keys, size_t from, size_t count, T key) {
+        size_t index = 0;
+        for (size_t i = from; i < count; ++i) {
+            index += keys[i] < key;
+        }
+        return index;
+    }
+};
+
+template<>
+struct LeafScan<int32_t> : VectorLeafScan<int32_t, LeafScan<int32_t>> {
+    __attribute__((target("avx512f"))) static size_t avx512(const int32_t *keys, size_t count, int32_t key) {
+        __m512i pivot = _mm512_set1_epi32(key);
+        size_t index = 0, i = 0;
+        for (; i + 16 <= count; i += 16) {
+            index += __builtin_popcount(_mm512_cmplt_epi32_mask(_mm512_loadu_si512(keys + i), pivot));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("avx2"))) static size_t avx2(const int32_t *keys, size_t count, int32_t key) {
+        __m256i pivot = _mm256_set1_epi32(key);
+        size_t index = 0, i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+            index += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(pivot, block))));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("sse4.2"))) static size_t sse(const int32_t *keys, size_t count, int32_t key) {
+        __m128i pivot = _mm_set1_epi32(key);
+        size_t index = 0, i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+            index += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(block, pivot))));
+        }
+        return index + tail(keys, i, count, key);
+    }
+};
+
+template<>
+struct LeafScan<int64_t> : VectorLeafScan<int64_t, LeafScan<int64_t>> {
+    __attribute__((target("avx512f"))) static size_t avx512(const int64_t *keys, size_t count, int64_t key) {
+        __m512i pivot = _mm512_set1_epi64(key);
+        size_t index = 0, i = 0;
+        for (; i + 8 <= count; i += 8) {
+            index += __builtin_popcount(_mm512_cmplt_epi64_mask(_mm512_loadu_si512(keys + i), pivot));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("avx2"))) static size_t avx2(const int64_t *keys, size_t count, int64_t key) {
+        __m256i pivot = _mm256_set1_epi64x(key);
+        size_t index = 0, i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+            index += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(pivot, block))));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("sse4.2"))) static size_t sse(const int64_t *keys, size_t count, int64_t key) {
+        __m128i pivot = _mm_set1_epi64x(key);
+        size_t index = 0, i = 0;
+        for (; i + 2 <= count; i += 2) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+            index += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(pivot, block))));
+        }
+        return index + tail(keys, i, count, key);
+    }
+};
+
+template<>
+struct LeafScan<float> : VectorLeafScan<float, LeafScan<float>> {
+    __attribute__((target("avx512f"))) static size_t avx512(const float *keys, size_t count, float key) {
+        __m512 pivot = _mm512_set1_ps(key);
+        size_t index = 0, i = 0;
+        for (; i + 16 <= count; i += 16) {
+            index += __builtin_popcount(_mm512_cmp_ps_mask(_mm512_loadu_ps(keys + i), pivot, _CMP_LT_OQ));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("avx2"))) static size_t avx2(const float *keys, size_t count, float key) {
+        __m256 pivot = _mm256_set1_ps(key);
+        size_t index = 0, i = 0;
+        for (; i + 8 <= count; i += 8) {
+            index += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(keys + i), pivot, _CMP_LT_OQ)));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("sse4.2"))) static size_t sse(const float *keys, size_t count, float key) {
+        __m128 pivot = _mm_set1_ps(key);
+        size_t index = 0, i = 0;
+        for (; i + 4 <= count; i += 4) {
+            index += __builtin_popcount(_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(keys + i), pivot)));
+        }
+        return index + tail(keys, i, count, key);
+    }
+};
+
+template<>
+struct LeafScan<double> : VectorLeafScan<double, LeafScan<double>> {
+    __attribute__((target("avx512f"))) static size_t avx512(const double *keys, size_t count, double key) {
+        __m512d pivot = _mm512_set1_pd(key);
+        size_t index = 0, i = 0;
+        for (; i + 8 <= count; i += 8) {
+            index += __builtin_popcount(_mm512_cmp_pd_mask(_mm512_loadu_pd(keys + i), pivot, _CMP_LT_OQ));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("avx2"))) static size_t avx2(const double *keys, size_t count, double key) {
+        __m256d pivot = _mm256_set1_pd(key);
+        size_t index = 0, i = 0;
+        for (; i + 4 <= count; i += 4) {
+            index += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(keys + i), pivot, _CMP_LT_OQ)));
+        }
+        return index + tail(keys, i, count, key);
+    }
+
+    __attribute__((target("sse4.2"))) static size_t sse(const double *keys, size_t count, double key) {
+        __m128d pivot = _mm_set1_pd(key);
+        size_t index = 0, i = 0;
+        for (; i + 2 <= count; i += 2) {
+            index += __builtin_popcount(_mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(keys + i), pivot)));
+        }
+        return index + tail(keys, i, count, key);
+    }
+};
+
+#endif
+
+// Owns one entry of a Map on the heap, so the entry keeps its address while its slot shifts
+// within its leaf or moves to another one. Copying a Boxed copies the entry.
+template<class V>
+class Boxed {
+
+private:
+    std::unique_ptr<V> value_;
+
+public:
+    Boxed() = default;
+
+    template<class... Args>
+    static Boxed make(Args &&... args) {
+        Boxed result;
+        result.value_.reset(new V(std::forward<Args>(args)...));
+        return result;
+    }
+
+    Boxed(const Boxed &other) : value_(other.value_ == nullptr ? nullptr : new V(*other.value_)) {}
+
+    Boxed(Boxed &&other) noexcept = default;
+
+    Boxed &operator=(const Boxed &other) {
+        value_.reset(other.value_ == nullptr ? nullptr : new V(*other.value_));
+        return *this;
+    }
+
+    Boxed &operator=(Boxed &&other) noexcept = default;
+
+    V &operator*() const {
+        return *value_;
+    }
+};
+
+// Vector of at most N elements stored inside the object itself, with the part of the std::vector
+// interface LeafEntries uses. It holds the entries of a tree too small to need any nodes.
+template<class X, size_t N>
+class FixedVector {
+
+private:
+    alignas(X) unsigned char storage_[N * sizeof(X)];
+    uint32_t count_ = 0;
+
+public:
+    using iterator = X *;
+    using const_iterator = const X *;
+
+    FixedVector() = default;
+
+    FixedVector(const FixedVector &other) {
+        insert(end(), other.begin(), other.end());
+    }
+
+    FixedVector(FixedVector &&other) noexcept {
+        insert(end(), std::make_move_iterator(other.begin()), std::make_move_iterator(other.end()));
+        other.clear();
+    }
+
+    FixedVector &operator=(const FixedVector &other) {
+        if (this != &other) {
+            clear();
+            insert(end(), other.begin(), other.end());
+        }
+        return *this;
+    }
+
+    FixedVector &operator=(FixedVector &&other) noexcept {
+        if (this != &other) {
+            clear();
+            insert(end(), std::make_move_iterator(other.begin()), std::make_move_iterator(other.end()));
+            other.clear();
+        }
+        return *this;
+    }
+
+    ~FixedVector() {
+        clear();
+    }
+
+    size_t size() const {
+        return count_;
+    }
+
+    bool empty() const {
+        return count_ == 0;
+    }
+
+    X *data() {
+        return reinterpret_cast<X *>(storage_);
+    }
+
+    const X *data() const {
+        return reinterpret_cast<const X *>(storage_);
+    }
+
+    X &operator[](size_t index) {
+        return data()[index];
+    }
+
+    const X &operator[](size_t index) const {
+        return data()[index];
+    }
+
+    const X &back() const {
+        return data()[count_ - 1];
+    }
+
+    iterator begin() {
+        return data();
+    }
+
+    iterator end() {
+        return data() + count_;
+    }
+
+    const_iterator begin() const {
+        return data();
+    }
+
+    const_iterator end() const {
+        return data() + count_;
+    }
+
+    void reserve(size_t) {
+    }
+
+    void insert(const_iterator pos, X element) {
+        assert(count_ < N);
+        size_t at = pos - data();
+        ::new (static_cast<void *>(end())) X(std::move(element));
+        count_++;
+        std::rotate(data() + at, end() - 1, end());
+    }
+
+    // Appends the range and rotates it into place.
+    template<class Iterator>
+    void insert(const_iterator pos, Iterator first, Iterator last) {
+        size_t at = pos - data();
+        size_t old = count_;
+        for (; first != last; ++first) {
+            assert(count_ < N);
+            ::new (static_cast<void *>(end())) X(*first);
+            count_++;
+        }
+        std::rotate(data() + at, data() + old, end());
+    }
+
+    void erase(const_iterator first, const_iterator last) {
+        X *to = data() + (first - data());
+        X *kept = std::move(data() + (last - data()), end(), to);
+        while (end() != kept) {
+            count_--;
+            end()->~X();
+        }
+    }
+
+    void clear() {
+        erase(begin(), end());
+    }
+};
+
+// Entry storage of a leaf: a vector on the heap, or a FixedVector for Inline entries.
+template<class X, size_t Inline>
+using LeafSequence = typename std::conditional<Inline == 0, std::vector<X>, FixedVector<X, Inline>>::type;
+
+// The sorted keys of one leaf and, in step with them, one V per key. A Boxed V is handed out as
+// the value it owns. With Inline above zero, the entries are kept in the object itself and there
+// may be at most Inline of them.
+template<class T, class V, size_t Inline = 0>
+class LeafEntries {
+
+private:
+    template<class S>
+    static S &unwrap(S &value) {
+        return value;
+    }
+
+    template<class U>
+    static U &unwrap(Boxed<U> &boxed) {
+        return *boxed;
+    }
+
+    template<class S>
+    struct SlotType {
+    };
+
+    template<class S, class... Args>
+    static S make_slot(SlotType<S>, Args &&... args) {
+        return S(std::forward<Args>(args)...);
+    }
+
+    template<class U, class... Args>
+    static Boxed<U> make_slot(SlotType<Boxed<U>>, Args &&... args) {
+        return Boxed<U>::make(std::forward<Args>(args)...);
+    }
+
+    template<class, class, size_t>
+    friend class LeafEntries;
+
+    LeafSequence<V, Inline> slots_;
+
+public:
+    // Bytes an entry takes, not counting what a slot owns elsewhere.
+    static constexpr size_t entry_size = sizeof(T) + sizeof(V);
+
+    LeafSequence<T, Inline> keys;
+
+    decltype(auto) value(size_t index) {
+        return unwrap(slots_[index]);
+    }
+
+    void reserve(size_t capacity) {
+        keys.reserve(capacity);
+        slots_.reserve(capacity);
+    }
+
+    template<class... Args>
+    void emplace(size_t index, const T &key, Args &&... args) {
+        keys.insert(keys.begin() + index, key);
+        slots_.insert(slots_.begin() + index, make_slot(SlotType<V>(), std::forward<Args>(args)...));
+    }
+
+    void erase(size_t from, size_t to) {
+        keys.erase(keys.begin() + from, keys.begin() + to);
+        slots_.erase(slots_.begin() + from, slots_.begin() + to);
+    }
+
+    // Moves count entries starting at from into other, before its entry at.
+    template<size_t OtherInline>
+    void transfer(LeafEntries<T, V, OtherInline> &other, size_t at, size_t from, size_t count) {
+        other.keys.insert(other.keys.begin() + at, std::make_move_iterator(keys.begin() + from),
+                          std::make_move_iterator(keys.begin() + from + count));
+        other.slots_.insert(other.slots_.begin() + at, std::make_move_iterator(slots_.begin() + from),
+                            std::make_move_iterator(slots_.begin() + from + count));
+        erase(from, from + count);
+    }
+
+    // Drops the entries whose mark is set and keeps the others in order. Trivially copyable
+    // entries are copied down unconditionally, so the loop does not branch on the marks.
+    void remove_marked(const char *marked) {
+        remove_marked(marked, std::integral_constant<bool, std::is_trivially_copyable<T>::value &&
+                                                           std::is_trivially_copyable<V>::value>());
+    }
+
+private:
+    void remove_marked(const char *marked, std::true_type) {
+        size_t kept = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys[kept] = keys[i];
+            slots_[kept] = slots_[i];
+            kept += !marked[i];
+        }
+        erase(kept, keys.size());
+    }
+
+    void remove_marked(const char *marked, std::false_type) {
+        size_t kept = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (marked[i]) {
+                continue;
+            }
+            if (kept != i) {
+                keys[kept] = std::move(keys[i]);
+                slots_[kept] = std::move(slots_[i]);
+            }
+            kept++;
+        }
+        erase(kept, keys.size());
+    }
+};
+
+template<class T, size_t Inline>
+class LeafEntries<T, void, Inline> {
+
+public:
+    static constexpr size_t entry_size = sizeof(T);
+
+    LeafSequence<T, Inline> keys;
+
+    void reserve(size_t capacity) {
+        keys.reserve(capacity);
+    }
+
+    void emplace(size_t index, const T &key) {
+        keys.insert(keys.begin() + index, key);
+    }
+
+    void erase(size_t from, size_t to) {
+        keys.erase(keys.begin() + from, keys.begin() + to);
+    }
+
+    template<size_t OtherInline>
+    void transfer(LeafEntries<T, void, OtherInline> &other, size_t at, size_t from, size_t count) {
+        other.keys.insert(other.keys.begin() + at, std::make_move_iterator(keys.begin() + from),
+                          std::make_move_iterator(keys.begin() + from + count));
+        erase(from, from + count);
+    }
+
+    void remove_marked(const char *marked) {
+        remove_marked(marked, std::is_trivially_copyable<T>());
+    }
+
+private:
+    void remove_marked(const char *marked, std::true_type) {
+        size_t kept = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys[kept] = keys[i];
+            kept += !marked[i];
+        }
+        erase(kept, keys.size());
+    }
+
+    void remove_marked(const char *marked, std::false_type) {
+        size_t kept = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (marked[i]) {
+                continue;
+            }
+            if (kept != i) {
+                keys[kept] = std::move(keys[i]);
+            }
+            kept++;
+        }
+        erase(kept, keys.size());
+    }
+};
+
+// Arena index of a node. The top bit tells leaves from internal nodes, which live in separate
+// pools; no_node stands for a missing link.
+using NodeId = uint32_t;
+
+constexpr NodeId leaf_tag = NodeId(1) << 31;
+
+constexpr NodeId no_node = ~NodeId(0);
+
+// The link from a node up to its parent, which trees with ParentLinks keep in every node.
+template<bool ParentLinks>
+struct ParentLink {
+    NodeId par = no_node;
+};
+
+template<>
+struct ParentLink<false> {
+};
+
+// The ancestors of a node, root first, as the descent that reached it recorded them; a tree
+// whose nodes keep no parent links climbs by popping them. Capacity 0 is the trail of a tree
+// that does keep the links: it records nothing and takes no room.
+template<class N, size_t Capacity>
+class NodeTrail {
+
+private:
+    N *nodes_[Capacity];
+    size_t depth_ = 0;
+
+public:
+    NodeTrail() = default;
+
+    // Only the recorded part is copied.
+    NodeTrail(const NodeTrail &other) : depth_(other.depth_) {
+        std::copy(other.nodes_, other.nodes_ + depth_, nodes_);
+    }
+
+    NodeTrail &operator=(const NodeTrail &other) {
+        depth_ = other.depth_;
+        std::copy(other.nodes_, other.nodes_ + depth_, nodes_);
+        return *this;
+    }
+
+    void push(N *node) {
+        assert(depth_ < Capacity);
+        nodes_[depth_++] = node;
+    }
+
+    // The last ancestor, taken off the trail; nullptr for the trail of a root.
+    N *pop() {
+        return depth_ == 0 ? nullptr : nodes_[--depth_];
+    }
+
+    N *back() const {
+        return depth_ == 0 ? nullptr : nodes_[depth_ - 1];
+    }
+
+    void clear() {
+        depth_ = 0;
+    }
+};
+
+template<class N>
+class NodeTrail<N, 0> {
+
+public:
+    void push(N *) {
+    }
+
+    N *pop() {
+        return nullptr;
+    }
+
+    N *back() const {
+        return nullptr;
+    }
+
+    void clear() {
+    }
+};
+
+// Slab storage for one kind of node. Nodes sit in blocks that never move, the first holding
+// eight and each next one twice as many as the one before, so a node keeps its address for its
+// whole life, a small tree does not reserve much, and a large one is a few dozen allocations that
+// go away together. Released slots are reset and reused before a new block is added.
+template<class N>
+class NodePool {
+
+private:
+    static constexpr size_t first_bits = 3;
+
+    static size_t block_size(size_t block) {
+        return size_t(1) << (block + first_bits);
+    }
+
+    static size_t floor_log2(size_t value) {
+#if defined(__GNUC__)
+        return 8 * sizeof(unsigned long) - 1 - __builtin_clzl(value);
+#else
+        size_t result = 0;
+        while (value >>= 1) {
+            result++;
+        }
+        return result;
+#endif
+    }
+
+    std::vector<std::unique_ptr<N[]>> blocks_;
+    std::vector<NodeId> free_;
+    NodeId used_ = 0;
+
+public:
+    NodePool() = default;
+
+    NodePool(const NodePool &other) : free_(other.free_), used_(other.used_) {
+        for (size_t block = 0; block < other.blocks_.size(); ++block) {
+            blocks_.emplace_back(new N[block_size(block)]);
+            std::copy(other.blocks_[block].get(), other.blocks_[block].get() + block_size(block),
+                      blocks_.back().get());
+        }
+    }
+
+    NodePool(NodePool &&other) noexcept = default;
+
+    NodePool &operator=(NodePool &&other) noexcept = default;
+
+    NodePool &operator=(const NodePool &other) = delete;
+
+    N &operator[](NodeId index) const {
+        size_t block = floor_log2((index >> first_bits) + 1);
+        return blocks_[block][index - (block_size(block) - block_size(0))];
+    }
+
+    NodeId allocate() {
+        if (!free_.empty()) {
+            NodeId index = free_.back();
+            free_.pop_back();
+            return index;
+        }
+        if (used_ == leaf_tag - 1) {
+            throw std::length_error("NodePool");
+        }
+        if (used_ == block_size(blocks_.size()) - block_size(0)) {
+            blocks_.emplace_back(new N[block_size(blocks_.size())]);
+        }
+        return used_++;
+    }
+
+    void release(NodeId index) {
+        (*this)[index] = N();
+        free_.push_back(index);
+    }
+
+    void swap(NodePool &other) noexcept {
+        blocks_.swap(other.blocks_);
+        free_.swap(other.free_);
+        std::swap(used_, other.used_);
+    }
+};
+
+// Child links of an internal node: up to three arena indices, plus room for the fourth one a
+// node holds until it is split. They sit inline, so a node is one fixed-size record.
+class ChildLinks {
+
+private:
+    NodeId ids_[4];
+    uint32_t count_ = 0;
+
+public:
+    using iterator = NodeId *;
+    using const_iterator = const NodeId *;
+
+    size_t size() const {
+        return count_;
+    }
+
+    bool empty() const {
+        return count_ == 0;
+    }
+
+    NodeId operator[](size_t index) const {
+        return ids_[index];
+    }
+
+    NodeId &operator[](size_t index) {
+        return ids_[index];
+    }
+
+    NodeId front() const {
+        return ids_[0];
+    }
+
+    NodeId back() const {
+        return ids_[count_ - 1];
+    }
+
+    iterator begin() {
+        return ids_;
+    }
+
+    iterator end() {
+        return ids_ + count_;
+    }
+
+    const_iterator begin() const {
+        return ids_;
+    }
+
+    const_iterator end() const {
+        return ids_ + count_;
+    }
+
+    void push_back(NodeId id) {
+        ids_[count_++] = id;
+    }
+
+    void pop_back() {
+        count_--;
+    }
+
+    void insert(iterator pos, NodeId id) {
+        std::copy_backward(pos, end(), end() + 1);
+        *pos = id;
+        count_++;
+    }
+
+    void erase(iterator pos) {
+        std::copy(pos + 1, end(), pos);
+        count_--;
+    }
+
+    template<class Iterator>
+    void assign(Iterator first, Iterator last) {
+        count_ = 0;
+        for (; first != last; ++first) {
+            push_back(*first);
+        }
+    }
+
+    void resize(size_t count) {
+        count_ = static_cast<uint32_t>(count);
+    }
+
+    void clear() {
+        count_ = 0;
+    }
+};
+
+// The 2-3 tree engine shared by Set, Map and Multiset. Internal nodes only route; the keys sit at
+// the bottom level, packed into leaves of up to leaf_capacity sorted keys, and when Value is not
+// void every key has a Value next to it in its leaf. Access decides what iterators dereference to.
+//
+// With ParentLinks, every node links back to its parent, and anything that climbs the tree reads
+// those links. Without, nodes are smaller and rewiring a child writes nothing into it: each
+// climb instead follows a Trail, the ancestors recorded by the descent that found its starting
+// point, and every iterator carries the trail of its leaf. Such an iterator stays valid while
+// its leaf holds entries, as with ParentLinks, but only until the tree above it changes shape,
+// meaning any insertion or erasure that splits or merges nodes.
+template<class T, class Value, class Access, bool ParentLinks = true>
+class TwoThreeTree {
+
+protected:
+    // Nodes live in the tree's arena and link to each other by 32-bit index, children inline and
+    // par, with ParentLinks, as a plain back link, so rewiring a child is a store and no node
+    // allocates anything of its own for its links. A node knows its own index, so a pointer to it
+    // can be turned back into a link. Every key is stored once, in its leaf; the only other copies
+    // are the separators of internal nodes.
+    struct Node : ParentLink<ParentLinks> {
+        ChildLinks children;
+        NodeId id = no_node;
+    };
+
+    using Linked = std::integral_constant<bool, ParentLinks>;
+
+    // Leaves are numbered with 31 bits and every internal node has at least two children, so no
+    // leaf has more ancestors than this.
+    static constexpr size_t max_height = 32;
+
+    using Trail = NodeTrail<Node, ParentLinks ? 0 : max_height>;
+
+    // Internal node. max_l and max_mid are the maxima of the first two children and drive
+    // routing; the maximum of the last child is never needed to route, so it is not kept, and
+    // each leaf's last key is a separator at most once, at the first ancestor where the path
+    // to the leaf does not take the last child.
+    struct Branch : Node {
+        T max_l, max_mid;
+    };
+
+    // Keys per leaf: a few cache lines of keys, so a leaf is scanned sequentially and the per-key
+    // share of the node overhead stays small.
+    static constexpr size_t leaf_capacity = std::max<size_t>(4, 256 / sizeof(T));
+
+    // Entries a tree keeps in its inline leaf before it moves them into the arena: as many as fit
+    // in a cache line, at least two and at most sixteen. It takes them back once it holds half as
+    // many, so a size going back and forth across the limit does not move them every time.
+    static constexpr size_t inline_capacity =
+            std::max<size_t>(2, std::min<size_t>(16, 64 / LeafEntries<T, Value>::entry_size));
+
+    // A leaf has no children and no separators.
+    struct Leaf : Node, LeafEntries<T, Value> {
+    };
+
+    // The leaf a tree without an arena keeps its entries in, inside the tree object. It is never
+    // linked to other nodes; it is a Node so that positions and iterators can point at it.
+    struct InlineLeaf : Node, LeafEntries<T, Value, inline_capacity> {
+    };
+
+    // Where an entry lives: its leaf and its index there. A null leaf stands for the end.
+    struct Position {
+        Node *leaf;
+        size_t index;
+    };
+
+    // A leaf to start a finger search from, and its trail; a null leaf starts at the root.
+    struct Hint {
+        Node *leaf;
+        Trail trail;
+    };
+
+    static Leaf *leaf(Node *node) {
+        return static_cast<Leaf *>(node);
+    }
+
+    static Branch *branch(Node *node) {
+        return static_cast<Branch *>(node);
+    }
+
+    // The leaves of a tree, in key order, as they stood when a background checkpoint began. The
+    // writer reads them one at a time under mutex; a leaf that is about to change or go away
+    // before the writer got to it has its keys saved first, so the writer sees the tree as it
+    // was without anything being copied up front. Each leaf is copied at most once.
+    class LeafPin {
+    public:
+        // A pin over the leaves in order, or over keys already copied when there are none.
+        LeafPin(std::vector<const Leaf *> leaves, std::vector<T> keys) : leaves_(std::move(leaves)) {
+            if (leaves_.empty()) {
+                leaves_.push_back(nullptr);
+                saved_.push_back(std::move(keys));
+                pending_.push_back(0);
+                return;
+            }
+            NodeId top = 0;
+            for (const Leaf *now: leaves_) {
+                top = std::max(top, (now->id & ~leaf_tag) + 1);
+            }
+            rank_.assign(top, 0);
+            for (size_t i = 0; i < leaves_.size(); ++i) {
+                rank_[leaves_[i]->id & ~leaf_tag] = i;
+            }
+            saved_.resize(leaves_.size());
+            pending_.assign(leaves_.size(), 1);
+            remaining_ = leaves_.size();
+        }
+
+        size_t size() const {
+            return leaves_.size();
+        }
+
+        // Hands the keys of leaf i to the writer: the copy saved for it, or the leaf itself,
+        // copied while no change can start.
+        void take(size_t i, std::vector<T> &keys) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_[i]) {
+                keys.assign(leaves_[i]->keys.begin(), leaves_[i]->keys.end());
+                pending_[i] = 0;
+                remaining_--;
+            } else {
+                keys.swap(saved_[i]);
+                std::vector<T>().swap(saved_[i]);
+            }
+        }
+
+        // Saves the keys of now if the writer still needs them. Returns whether the writer needs
+        // nothing more from the tree, so the pin can be dropped.
+        bool save(const Node *now) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            NodeId index = now->id & ~leaf_tag;
+            if (index < rank_.size() && leaves_[rank_[index]] == now && pending_[rank_[index]]) {
+                saved_[rank_[index]] = static_cast<const Leaf *>(now)->keys;
+                pending_[rank_[index]] = 0;
+                remaining_--;
+            }
+            return remaining_ == 0;
+        }
+
+        // Saves every leaf the writer has not read yet, for a tree that is going away.
+        void save_all() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < leaves_.size(); ++i) {
+                if (pending_[i]) {
+                    saved_[i] = leaves_[i]->keys;
+                    pending_[i] = 0;
+                }
+            }
+            remaining_ = 0;
+        }
+
+        // Called by a writer that stops early: nothing is read or saved from here on.
+        void abandon() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::fill(pending_.begin(), pending_.end(), 0);
+            saved_.clear();
+            remaining_ = 0;
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<const Leaf *> leaves_;
+        // Position in leaves_ by leaf pool index.
+        std::vector<size_t> rank_;
+        std::vector<std::vector<T>> saved_;
+        std::vector<char> pending_;
+        size_t remaining_ = 0;
+    };
+
+    // Every node of a tree that outgrew its inline leaf, and the links into them. The arena sits
+    // on the heap behind the tree and keeps its address when the tree is moved or swapped, so an
+    // iterator steps from leaf to leaf through the arena it was made in without going back to the
+    // tree. A tree small enough for its inline leaf has no arena at all.
+    struct Arena {
+        // Never null while the arena belongs to a tree, outside of the operations rebuilding it.
+        Node *root = nullptr;
+
+        // Cached rightmost leaf, or nullptr when it has to be looked up again.
+        Node *last = nullptr;
+
+        // Roots of the detached subtrees waiting for reclaim_nodes, and the entries under them.
+        std::vector<NodeId> graveyard;
+        size_t parked = 0;
+
+        // Internal nodes and leaves apart.
+        NodePool<Branch> branches;
+        NodePool<Leaf> leaves;
+
+        // The checkpoint reading the leaves in the background, if any; see preserve.
+        std::shared_ptr<LeafPin> pin;
+
+        Arena() = default;
+
+        // The pools are copied block by block, so every node keeps its index and the links need
+        // no rewriting; only the root is looked up again. The copies of parked subtrees are freed
+        // right away instead of being parked a second time.
+        Arena(const Arena &other) : branches(other.branches), leaves(other.leaves) {
+            if (other.root != nullptr) {
+                root = node(other.root->id);
+            }
+            for (NodeId id: other.graveyard) {
+                release_subtree(node(id));
+            }
+        }
+
+        Arena &operator=(const Arena &other) = delete;
+
+        ~Arena() {
+            unpin();
+        }
+
+        // Must be called before the entries of a leaf change or the leaf is released, so that a
+        // checkpoint still to read it gets its keys as they were.
+        void preserve(const Node *now) {
+            if (pin != nullptr && pin->save(now)) {
+                pin.reset();
+            }
+        }
+
+        // Hands every leaf a running checkpoint has not read yet over to it.
+        void unpin() {
+            if (pin != nullptr) {
+                pin->save_all();
+                pin.reset();
+            }
+        }
+
+        Node *node(NodeId id) const {
+            if (id & leaf_tag) {
+                return &leaves[id & ~leaf_tag];
+            }
+            return &branches[id];
+        }
+
+        Node *leftmost(Node *now) const {
+            while (!now->children.empty()) {
+                now = node(now->children[0]);
+            }
+            return now;
+        }
+
+        Node *rightmost(Node *now) const {
+            while (!now->children.empty()) {
+                now = node(now->children.back());
+            }
+            return now;
+        }
+
+        // Same as the above, pushing the nodes passed on the way down onto trail.
+        Node *leftmost(Node *now, Trail &trail) const {
+            while (!now->children.empty()) {
+                trail.push(now);
+                now = node(now->children[0]);
+            }
+            return now;
+        }
+
+        Node *rightmost(Node *now, Trail &trail) const {
+            while (!now->children.empty()) {
+                trail.push(now);
+                now = node(now->children.back());
+            }
+            return now;
+        }
+
+        // Parent of now, whose ancestors trail holds, or nullptr for a root.
+        Node *parent(const Node *now, const Trail &trail) const {
+            return parent(now, trail, Linked());
+        }
+
+        Node *parent(const Node *now, const Trail &, std::true_type) const {
+            return now->par == no_node ? nullptr : node(now->par);
+        }
+
+        Node *parent(const Node *, const Trail &trail, std::false_type) const {
+            return trail.back();
+        }
+
+        // Same as parent, also moving trail up to hold the ancestors of the parent.
+        Node *climb(const Node *now, Trail &trail) const {
+            Node *par = parent(now, trail);
+            trail.pop();
+            return par;
+        }
+
+        // The leaf after now, with trail moved from now's ancestors to its own; nullptr at the end.
+        Node *next_leaf(Node *now, Trail &trail) const {
+            Node *par = climb(now, trail);
+            while (par != nullptr && now->id == par->children.back()) {
+                now = par;
+                par = climb(now, trail);
+            }
+            if (par == nullptr) {
+                return nullptr;
+            }
+            trail.push(par);
+            const ChildLinks &siblings = par->children;
+            return leftmost(node(siblings[1] == now->id ? siblings[2] : siblings[1]), trail);
+        }
+
+        Node *prev_leaf(Node *now, Trail &trail) const {
+            Node *par = climb(now, trail);
+            while (par != nullptr && now->id == par->children[0]) {
+                now = par;
+                par = climb(now, trail);
+            }
+            if (par == nullptr) {
+                return nullptr;
+            }
+            trail.push(par);
+            const ChildLinks &siblings = par->children;
+            return rightmost(node(siblings[1] == now->id ? siblings[0] : siblings[1]), trail);
+        }
+
+        void release(Node *now) {
+            if (now->id & leaf_tag) {
+                preserve(now);
+                leaves.release(now->id & ~leaf_tag);
+            } else {
+                branches.release(now->id);
+            }
+        }
+
+        // Returns every node of the detached subtree under top to the pools.
+        void release_subtree(Node *top) {
+            std::vector<Node *> pending(1, top);
+            while (!pending.empty()) {
+                Node *now = pending.back();
+                pending.pop_back();
+                for (NodeId id: now->children) {
+                    pending.push_back(node(id));
+                }
+                release(now);
+            }
+        }
+    };
+
+    // The navigation helpers below only make sense for a tree with an arena.
+    Node *node(NodeId id) const {
+        return arena_->node(id);
+    }
+
+    Node *child(const Node *now, size_t index) const {
+        return node(now->children[index]);
+    }
+
+    Node *parent(const Node *now, const Trail &trail) const {
+        return arena_->parent(now, trail);
+    }
+
+    Node *climb(const Node *now, Trail &trail) const {
+        return arena_->climb(now, trail);
+    }
+
+    // Records par as the parent of now; nothing to do without ParentLinks.
+    static void set_parent(Node *now, NodeId par) {
+        set_parent(now, par, Linked());
+    }
+
+    static void set_parent(Node *now, NodeId par, std::true_type) {
+        now->par = par;
+    }
+
+    static void set_parent(Node *, NodeId, std::false_type) {
+    }
+
+    Node *root() const {
+        return arena_->root;
+    }
+
+    Node *leftmost(Node *now) const {
+        return arena_->leftmost(now);
+    }
+
+    Node *rightmost(Node *now) const {
+        return arena_->rightmost(now);
+    }
+
+    Node *leftmost(Node *now, Trail &trail) const {
+        return arena_->leftmost(now, trail);
+    }
+
+    Node *rightmost(Node *now, Trail &trail) const {
+        return arena_->rightmost(now, trail);
+    }
+
+    Node *next_leaf(Node *now, Trail &trail) const {
+        return arena_->next_leaf(now, trail);
+    }
+
+    Node *prev_leaf(Node *now, Trail &trail) const {
+        return arena_->prev_leaf(now, trail);
+    }
+
+    // The trail of a leaf of the tree found by descending to its first key, for code that holds
+    // a leaf without its trail. The tree must route correctly to the leaf, which may only have a
+    // stale maximum above it. With ParentLinks there is nothing to record and nothing is walked.
+    Trail trail_to(Node *now) const {
+        Trail trail;
+        if (!ParentLinks && arena_ != nullptr && now != inline_leaf()) {
+            Node *found = find_vertex(root(), leaf(now)->keys.front(), trail);
+            assert(found == now);
+            (void) found;
+        }
+        return trail;
+    }
+
+    // Positions and iterators hold mutable leaf pointers whatever the constness of the tree, the
+    // inline leaf's like those into the arena.
+    InlineLeaf *inline_leaf() const {
+        return const_cast<InlineLeaf *>(&inline_);
+    }
+
+    // A fresh leaf, with room for leaf_capacity keys, or internal node from the arena. The first
+    // node a tree takes brings its arena into being.
+    Leaf *new_leaf() {
+        if (arena_ == nullptr) {
+            arena_.reset(new Arena());
+        }
+        NodeId index = arena_->leaves.allocate();
+        Leaf *result = &arena_->leaves[index];
+        result->id = index | leaf_tag;
+        result->reserve(leaf_capacity);
+        return result;
+    }
+
+    Branch *new_branch() {
+        if (arena_ == nullptr) {
+            arena_.reset(new Arena());
+        }
+        NodeId index = arena_->branches.allocate();
+        Branch *result = &arena_->branches[index];
+        result->id = index;
+        return result;
+    }
+
+    void free_node(Node *node) {
+        arena_->release(node);
+    }
+
+    // See Arena::preserve; called for a leaf of the arena before its entries change.
+    void preserve(Node *now) {
+        arena_->preserve(now);
+    }
+
+    // Starts a background read of the keys: pins the leaves in order, in O(n / leaf_capacity),
+    // or copies the few keys of a tree without an arena. A pin still running from an earlier
+    // call is handed its leaves first.
+    std::shared_ptr<LeafPin> pin_leaves() const {
+        if (arena_ == nullptr) {
+            return std::make_shared<LeafPin>(std::vector<const Leaf *>(),
+                                             std::vector<T>(inline_.keys.begin(), inline_.keys.end()));
+        }
+        arena_->unpin();
+        std::vector<const Leaf *> leaves;
+        Trail trail;
+        for (Node *now = leftmost(root(), trail); now != nullptr; now = next_leaf(now, trail)) {
+            leaves.push_back(leaf(now));
+        }
+        arena_->pin = std::make_shared<LeafPin>(std::move(leaves), std::vector<T>());
+        return arena_->pin;
+    }
+
+    // Largest key under node: the last key of its rightmost leaf, found in O(height).
+    const T &max_key(Node *node) const {
+        return leaf(rightmost(node))->keys.back();
+    }
+
+
+    // Index of the first key in keys not less than key. Arithmetic keys are counted by LeafScan,
+    // a branch-free sequential scan (vectorized for the common key types) that beats binary search
+    // on a leaf this short; other keys are binary searched.
+    template<class Keys>
+    static size_t lower_index(const Keys &keys, const T &key) {
+        return lower_index(keys, key, std::is_arithmetic<T>());
+    }
+
+    template<class Keys>
+    static size_t lower_index(const Keys &keys, const T &key, std::true_type) {
+        return LeafScan<T>::count_less(keys.data(), keys.size(), key);
+    }
+
+    template<class Keys>
+    static size_t lower_index(const Keys &keys, const T &key, std::false_type) {
+        return binary_search_index(keys, key, std::is_trivially_copyable<T>());
+    }
+
+    // Trivially copyable keys are cheap to compare in place, so the search halves the range with a
+    // conditional move instead of a branch the predictor would miss half the time.
+    template<class Keys>
+    static size_t binary_search_index(const Keys &keys, const T &key, std::true_type) {
+        if (keys.empty()) {
+            return 0;
+        }
+        const T *base = keys.data();
+        for (size_t count = keys.size(); count > 1; count -= count / 2) {
+            base = base[count / 2] < key ? base + count / 2 : base;
+        }
+        return (base - keys.data()) + (*base < key);
+    }
+
+    template<class Keys>
+    static size_t binary_search_index(const Keys &keys, const T &key, std::false_type) {
+        return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    }
+
+    static ChildLinks::iterator find_child(Node *par, const Node *child) {
+        return std::find(par->children.begin(), par->children.end(), child->id);
+    }
+
+    // Position of the smallest key not less than key in the leaf found, whose ancestors trail
+    // holds, or of the first key of the next leaf when every key there is smaller. trail ends up
+    // holding the ancestors of the leaf returned.
+    Position lower_position(Node *found, Trail &trail, const T &key) const {
+        if (found == nullptr) {
+            return Position{nullptr, 0};
+        }
+        size_t index = lower_index(leaf(found)->keys, key);
+        if (index == leaf(found)->keys.size()) {
+            return Position{next_leaf(found, trail), 0};
+        }
+        return Position{found, index};
+    }
+
+    // Position of key in the leaf found, or the end when it is absent.
+    Position exact_position(Node *found, Trail &trail, const T &key) const {
+        Position pos = lower_position(found, trail, key);
+        if (pos.leaf == nullptr || key < leaf(pos.leaf)->keys[pos.index]) {
+            return Position{nullptr, 0};
+        }
+        return pos;
+    }
+
+    // Key at a position that is not the end, in the inline leaf or not.
+    const T &key_at(Position pos) const {
+        return arena_ == nullptr ? inline_.keys[pos.index] : leaf(pos.leaf)->keys[pos.index];
+    }
+
+    // Same as the above, from the root of the whole tree; trail must be empty.
+    Position lower_position(const T &key, Trail &trail) const {
+        if (arena_ == nullptr) {
+            size_t index = lower_index(inline_.keys, key);
+            return index == size_ ? Position{nullptr, 0} : Position{inline_leaf(), index};
+        }
+        return lower_position(find_vertex(root(), key, trail), trail, key);
+    }
+
+    Position find_position(const T &key, Trail &trail) const {
+        Position pos = lower_position(key, trail);
+        if (pos.leaf == nullptr || key < key_at(pos)) {
+            return Position{nullptr, 0};
+        }
+        return pos;
+    }
+
+    Position find_position(const T &key) const {
+        Trail trail;
+        return find_position(key, trail);
+    }
+
+    bool is_equal(const T &element1, const T &element2) const {
+        return !(element1 < element2) && !(element2 < element1);
+    }
+
+    // The leaf under now a search for key ends at. The nodes passed on the way are pushed onto
+    // trail, which therefore has to hold the ancestors of now.
+    Node *find_vertex(Node *now, const T &key, Trail &trail) const {
+        if (now == nullptr) {
+            return nullptr;
+        }
+        while (!now->children.empty()) {
+            trail.push(now);
+            if (now->children.size() == 3 && branch(now)->max_mid < key) {
+                now = child(now, 2);
+            } else if (branch(now)->max_l < key) {
+                now = child(now, 1);
+            } else {
+                now = child(now, 0);
+            }
+        }
+        return now;
+    }
+
+    // Same leaf as find_vertex from the root, but reached by climbing from hint only until the
+    // subtree above it covers key: O(log d) for a key d leaves away from the hint. A subtree's
+    // maximum is read from the separator its parent keeps for it; a last child has none, so the
+    // climb goes on to the parent, which shares its maximum. trail, the ancestors of hint, ends up
+    // holding those of the leaf found.
+    Node *find_vertex_near(Node *hint, Trail &trail, const T &key) const {
+        if (hint == nullptr) {
+            trail.clear();
+            return find_vertex(root(), key, trail);
+        }
+        Node *now = hint;
+        if (leaf(hint)->keys.back() < key) {
+            while (Node *up = parent(now, trail)) {
+                Branch *par = branch(up);
+                if (now->id != par->children.back() &&
+                    !((now->id == par->children[0] ? par->max_l : par->max_mid) < key)) {
+                    break;
+                }
+                now = climb(now, trail);
+            }
+        } else {
+            while (Node *up = parent(now, trail)) {
+                Branch *par = branch(up);
+                const ChildLinks &siblings = par->children;
+                if (now->id != siblings[0] && (now->id == siblings[1] ? par->max_l : par->max_mid) < key) {
+                    break;
+                }
+                now = climb(now, trail);
+            }
+        }
+        return find_vertex(now, key, trail);
+    }
+
+    void make_new_root(Node *node1, Node *node2) {
+        Branch *new_root = new_branch();
+        new_root->children.push_back(node1->id);
+        new_root->children.push_back(node2->id);
+        update_node(new_root);
+        arena_->root = new_root;
+    }
+
+    // Adopts the children of an internal node, which must be in order, and recomputes its
+    // separators.
+    void update_node(Node *now) const {
+        for (NodeId element: now->children) {
+            set_parent(node(element), now->id);
+        }
+        update_separators(now);
+    }
+
+    // Rewrites the one separator that holds the maximum of node after that maximum changed: the
+    // one at the first ancestor where the path to node does not take the last child. Nothing
+    // holds the maximum of a node on the right spine. trail holds the ancestors of now.
+    void update_max_above(Node *now, Trail trail) const {
+        const T &max = max_key(now);
+        Node *up = climb(now, trail);
+        while (up != nullptr && now->id == up->children.back()) {
+            now = up;
+            up = climb(now, trail);
+        }
+        if (up == nullptr) {
+            return;
+        }
+        Branch *par = branch(up);
+        if (now->id == par->children[0]) {
+            par->max_l = max;
+        } else {
+            par->max_mid = max;
+        }
+    }
+
+    // Splits every node on the way up from node, whose ancestors trail holds, that holds four
+    // children: it keeps the first two in place and hands the other two to one new sibling right
+    // after it.
+    void go_up(Node *node, Trail &trail) {
+        while (node->children.size() > 3) {
+            Branch *right = new_branch();
+            right->children.assign(node->children.begin() + 2, node->children.end());
+            node->children.resize(2);
+            update_node(right);
+            update_separators(node);
+            Node *par = climb(node, trail);
+            if (par == nullptr) {
+                make_new_root(root(), right);
+                return;
+            }
+            set_parent(right, par->id);
+            par->children.insert(find_child(par, node) + 1, right->id);
+            update_separators(par);
+            node = par;
+        }
+    }
+
+    // Recomputes the separators of a node whose children are in order, leaving their parent
+    // pointers alone. Each separator is read from the rightmost leaf below its child.
+    void update_separators(Node *node) const {
+        branch(node)->max_l = max_key(child(node, 0));
+        if (node->children.size() > 2) {
+            branch(node)->max_mid = max_key(child(node, 1));
+        }
+    }
+
+    // Places key at index of current, a leaf that does not hold it yet. A leaf pushed over
+    // capacity keeps its lower half and hands the upper half to a new leaf, which is returned
+    // for the caller to link in right after current.
+    template<class... Args>
+    std::pair<Position, Leaf *> emplace_in_leaf(Leaf *current, size_t index, const T &key, Args &&... args) {
+        preserve(current);
+        current->emplace(index, key, std::forward<Args>(args)...);
+        size_++;
+        if (current->keys.size() <= leaf_capacity) {
+            return std::make_pair(Position{current, index}, static_cast<Leaf *>(nullptr));
+        }
+        Leaf *right = new_leaf();
+        size_t half = current->keys.size() / 2;
+        current->transfer(*right, 0, half, current->keys.size() - half);
+        if (arena_->last == current) {
+            arena_->last = right;
+        }
+        Position pos = index < half ? Position{current, index} : Position{right, index - half};
+        return std::make_pair(pos, right);
+    }
+
+    // Adds key to the inline leaf of a tree without an arena. Returns false, without touching
+    // anything, when the inline leaf is full and key is absent, and the caller has to spill the
+    // entries into an arena; otherwise returns the position of key and whether it was inserted.
+    template<class... Args>
+    bool insert_inline(const T &key, std::pair<Position, bool> &result, Args &&... args) {
+        size_t index = lower_index(inline_.keys, key);
+        if (index < size_ && !(key < inline_.keys[index])) {
+            result = std::make_pair(Position{&inline_, index}, false);
+            return true;
+        }
+        if (size_ == inline_capacity) {
+            return false;
+        }
+        inline_.emplace(index, key, std::forward<Args>(args)...);
+        size_++;
+        result = std::make_pair(Position{&inline_, index}, true);
+        return true;
+    }
+
+    // Returns the position of key and whether it was inserted; args construct the key's Value
+    // and are only consumed when the key was absent.
+    //
+    // Insertion is one descent from the root. A key routed into a non-last child never exceeds
+    // that child's maximum, so no separator on the way down changes; the descent only records
+    // the path and the child taken at each step. The key goes into the leaf the descent ends at,
+    // and when that leaf splits, overflowing nodes are split in place while walking back along
+    // the recorded path, stopping at the first node with room. Splitting a 3-node ahead of time
+    // would leave a node with a single child, so 2-3 trees cannot split preemptively; following
+    // the recorded path gives the same single pass without climbing parent pointers.
+    template<class... Args>
+    std::pair<Position, bool> insert_to_tree(const T &key, Args &&... args) {
+        if (arena_ == nullptr) {
+            std::pair<Position, bool> result;
+            if (insert_inline(key, result, std::forward<Args>(args)...)) {
+                return result;
+            }
+            spill_inline();
+        }
+        if (max_key(last_leaf()) < key) {
+            return std::make_pair(append_key(key, std::forward<Args>(args)...), true);
+        }
+        Node *path[64];
+        size_t taken[64];
+        size_t depth = 0;
+        Node *now = root();
+        while (!now->children.empty()) {
+            size_t index = 0;
+            if (now->children.size() == 3 && branch(now)->max_mid < key) {
+                index = 2;
+            } else if (branch(now)->max_l < key) {
+                index = 1;
+            }
+            path[depth] = now;
+            taken[depth++] = index;
+            now = child(now, index);
+        }
+        Leaf *found = leaf(now);
+        size_t index = lower_index(found->keys, key);
+        if (index < found->keys.size() && !(key < found->keys[index])) {
+            return std::make_pair(Position{found, index}, false);
+        }
+        std::pair<Position, Leaf *> placed = emplace_in_leaf(found, index, key, std::forward<Args>(args)...);
+        if (placed.second == nullptr) {
+            return std::make_pair(placed.first, true);
+        }
+        if (depth == 0) {
+            make_new_root(root(), placed.second);
+            return std::make_pair(placed.first, true);
+        }
+        Node *par = path[depth - 1];
+        set_parent(placed.second, par->id);
+        par->children.insert(par->children.begin() + taken[depth - 1] + 1, placed.second->id);
+        split_path(path, taken, depth);
+        return std::make_pair(placed.first, true);
+    }
+
+    // Walks back along a recorded insertion path: every node that reached four children keeps
+    // the first two and hands the other two to one new sibling placed right after it.
+    void split_path(Node *const *path, const size_t *taken, size_t depth) {
+        for (size_t i = depth; i-- > 0;) {
+            Node *node = path[i];
+            if (node->children.size() < 4) {
+                update_separators(node);
+                return;
+            }
+            Branch *right = new_branch();
+            right->children.assign(node->children.begin() + 2, node->children.end());
+            node->children.resize(2);
+            update_node(right);
+            update_separators(node);
+            if (i == 0) {
+                make_new_root(root(), right);
+                return;
+            }
+            Node *par = path[i - 1];
+            set_parent(right, par->id);
+            par->children.insert(par->children.begin() + taken[i - 1] + 1, right->id);
+        }
+    }
+
+    // Same as insert_to_tree, but the leaf is located by a finger search from hint.
+    template<class... Args>
+    std::pair<Position, bool> insert_near(Hint hint, const T &key, Args &&... args) {
+        if (arena_ == nullptr) {
+            return insert_to_tree(key, std::forward<Args>(args)...);
+        }
+        Node *found = find_vertex_near(hint.leaf, hint.trail, key);
+        return insert_at(found, hint.trail, key, std::forward<Args>(args)...);
+    }
+
+    // Inserts into found, the leaf a search for key ends at, whose ancestors trail holds. Only the
+    // nodes whose maximum changes and the nodes that split are touched, so nothing forces a walk
+    // to the root.
+    template<class... Args>
+    std::pair<Position, bool> insert_at(Node *found, Trail &trail, const T &key, Args &&... args) {
+        Node *last = last_leaf();
+        if (found == last && max_key(last) < key) {
+            return std::make_pair(append_key(key, std::forward<Args>(args)...), true);
+        }
+        Leaf *current = leaf(found);
+        size_t index = lower_index(current->keys, key);
+        if (index < current->keys.size() && !(key < current->keys[index])) {
+            return std::make_pair(Position{current, index}, false);
+        }
+        std::pair<Position, Leaf *> placed = emplace_in_leaf(current, index, key, std::forward<Args>(args)...);
+        if (placed.second == nullptr) {
+            return std::make_pair(placed.first, true);
+        }
+        Node *par = climb(current, trail);
+        if (par == nullptr) {
+            make_new_root(root(), placed.second);
+        } else {
+            set_parent(placed.second, par->id);
+            par->children.insert(find_child(par, current) + 1, placed.second->id);
+            update_separators(par);
+            go_up(par, trail);
+        }
+        return std::make_pair(placed.first, true);
+    }
+
+    Node *last_leaf() {
+        if (arena_->last == nullptr && arena_->root != nullptr) {
+            arena_->last = rightmost(arena_->root);
+        }
+        return arena_->last;
+    }
+
+    // Same as the above, with trail, which must be empty, getting the ancestors of the leaf. The
+    // cached leaf comes without them, so without ParentLinks the right spine is walked down.
+    Node *last_leaf(Trail &trail) {
+        if (ParentLinks || arena_->root == nullptr) {
+            return last_leaf();
+        }
+        return arena_->last = rightmost(arena_->root, trail);
+    }
+
+    // Largest key of a non-empty tree.
+    const T &back_key() {
+        return arena_ == nullptr ? inline_.keys.back() : max_key(last_leaf());
+    }
+
+    // Appends a key greater than every key in the tree to the cached rightmost leaf, or to a new
+    // leaf after it once it is full. Nothing routes by the maximum of the right spine, so only
+    // that leaf's parent has its separators refreshed and splits climb the right spine; the cost
+    // is amortized O(1).
+    template<class... Args>
+    Position append_key(const T &key, Args &&... args) {
+        if (arena_ == nullptr) {
+            if (size_ < inline_capacity) {
+                inline_.emplace(size_, key, std::forward<Args>(args)...);
+                return Position{&inline_, size_++};
+            }
+            spill_inline();
+        }
+        Node *last = last_leaf();
+        if (leaf(last)->keys.size() < leaf_capacity) {
+            size_t index = leaf(last)->keys.size();
+            preserve(last);
+            leaf(last)->emplace(index, key, std::forward<Args>(args)...);
+            size_++;
+            return Position{last, index};
+        }
+        Leaf *appended = new_leaf();
+        appended->emplace(0, key, std::forward<Args>(args)...);
+        size_++;
+        append_leaf(appended);
+        return Position{appended, 0};
+    }
+
+    // Links appended, a filled leaf whose keys are all greater than every key in the tree, in
+    // after the last leaf, in amortized O(1) for the same reason as append_key, plus a walk down
+    // the right spine for the trail of the last leaf without ParentLinks. It does not touch
+    // size_.
+    void append_leaf(Leaf *appended) {
+        Trail trail;
+        Node *last = last_leaf(trail);
+        Node *par = last == nullptr ? nullptr : climb(last, trail);
+        if (last == nullptr) {
+            arena_->root = appended;
+        } else if (par == nullptr) {
+            make_new_root(root(), appended);
+        } else {
+            par->children.push_back(appended->id);
+            set_parent(appended, par->id);
+            update_separators(par);
+            go_up(par, trail);
+        }
+        arena_->last = appended;
+    }
+
+    // A tree of at most inline_capacity entries keeps them in inline_, a leaf embedded in the
+    // tree itself, and has no arena, so a small tree allocates no nodes. Once inline_ is full,
+    // its entries move into the first leaf of a new arena before anything is added.
+    void spill_inline() {
+        if (arena_ != nullptr) {
+            return;
+        }
+        Leaf *moved = new_leaf();
+        inline_.transfer(*moved, 0, 0, size_);
+        arena_->root = arena_->last = moved;
+    }
+
+    // Called after entries were removed: a tree down to one leaf of at most half of
+    // inline_capacity entries moves them back into inline_ and drops its arena, and with them
+    // anything parked in the graveyard. Returns pos, moved along with its entry.
+    Position settle(Position pos) {
+        if (arena_ == nullptr) {
+            return pos;
+        }
+        Node *old = arena_->root;
+        if (old != nullptr && (!old->children.empty() || size_ > inline_capacity / 2)) {
+            return pos;
+        }
+        if (old != nullptr) {
+            preserve(old);
+            leaf(old)->transfer(inline_, 0, 0, size_);
+            if (pos.leaf == old) {
+                pos.leaf = &inline_;
+            }
+        }
+        arena_.reset();
+        return pos;
+    }
+
+    // Restores a node left with a single child. A child is borrowed from an adjacent sibling
+    // with three children when there is one; otherwise the child moves into a sibling with two
+    // and node is dropped, which may leave the parent short in turn. Siblings are reused in
+    // place, so nothing is allocated, and the keys under par stay the same, so no separator
+    // above it changes.
+    void fix_underflow(Node *now, Trail &trail) {
+        while (true) {
+            Node *par = climb(now, trail);
+            if (par == nullptr) {
+                arena_->root = child(now, 0);
+                set_parent(arena_->root, no_node);
+                free_node(now);
+                return;
+            }
+            ChildLinks &siblings = par->children;
+            size_t index = find_child(par, now) - siblings.begin();
+            size_t other = index > 0 ? index - 1 : index + 1;
+            if (index > 0 && index + 1 < siblings.size() && child(par, index + 1)->children.size() == 3) {
+                other = index + 1;
+            }
+            Node *sibling = child(par, other);
+            ChildLinks &lender = sibling->children;
+            if (lender.size() == 3) {
+                if (other < index) {
+                    now->children.insert(now->children.begin(), lender.back());
+                    lender.pop_back();
+                } else {
+                    now->children.push_back(lender.front());
+                    lender.erase(lender.begin());
+                }
+                update_node(sibling);
+                update_node(now);
+                update_separators(par);
+                return;
+            }
+            if (other < index) {
+                lender.push_back(now->children[0]);
+            } else {
+                lender.insert(lender.begin(), now->children[0]);
+            }
+            update_node(sibling);
+            siblings.erase(siblings.begin() + index);
+            free_node(now);
+            if (siblings.size() > 1) {
+                update_separators(par);
+                return;
+            }
+            now = par;
+        }
+    }
+
+    // Returns whether key was present.
+    bool erase_in_tree(const T &key) {
+        Trail trail;
+        Position pos = find_position(key, trail);
+        if (pos.leaf == nullptr) {
+            return false;
+        }
+        erase_at(pos, trail);
+        return true;
+    }
+
+    // Unlinks an emptied leaf, whose ancestors trail holds, from the tree. The separator that
+    // held its maximum, if any, now belongs to the leaf before it.
+    void remove_leaf(Node *vertex, Trail &trail) {
+        if (vertex == arena_->last) {
+            arena_->last = nullptr;
+        }
+        Trail around = trail;
+        Node *prev = prev_leaf(vertex, around);
+        Node *par = climb(vertex, trail);
+        if (par == nullptr) {
+            arena_->root = nullptr;
+            free_node(vertex);
+            return;
+        }
+        par->children.erase(find_child(par, vertex));
+        free_node(vertex);
+        if (par->children.size() > 1) {
+            update_separators(par);
+        } else {
+            fix_underflow(par, trail);
+        }
+        if (prev != nullptr) {
+            // The fix-up may have moved prev under other ancestors than the ones around holds.
+            update_max_above(prev, trail_to(prev));
+        }
+    }
+
+    // Erases the entry at pos, starting from its leaf instead of searching from the root, and
+    // returns the position of the entry that followed it. trail holds the ancestors of the leaf.
+    Position erase_at(Position pos, Trail &trail) {
+        if (arena_ == nullptr) {
+            inline_.erase(pos.index, pos.index + 1);
+            size_--;
+            return pos.index == size_ ? Position{nullptr, 0} : pos;
+        }
+        return settle(erase_in_leaf(pos, trail));
+    }
+
+    Position erase_at(Position pos) {
+        Trail trail = trail_to(pos.leaf);
+        return erase_at(pos, trail);
+    }
+
+    // A leaf left less than a quarter full is merged into an adjacent sibling when both fit in
+    // one leaf.
+    Position erase_in_leaf(Position pos, Trail &trail) {
+        Leaf *current = leaf(pos.leaf);
+        preserve(current);
+        current->erase(pos.index, pos.index + 1);
+        size_--;
+        Position next = pos;
+        if (pos.index == current->keys.size()) {
+            Trail around = trail;
+            next = Position{next_leaf(current, around), 0};
+        }
+        if (current->keys.empty()) {
+            remove_leaf(current, trail);
+            return next;
+        }
+        if (pos.index == current->keys.size()) {
+            update_max_above(current, trail);
+        }
+        Node *par = parent(current, trail);
+        if (par == nullptr || current->keys.size() >= leaf_capacity / 4) {
+            return next;
+        }
+        ChildLinks &siblings = par->children;
+        size_t index = find_child(par, current) - siblings.begin();
+        size_t count = current->keys.size();
+        if (index > 0 && leaf(child(par, index - 1))->keys.size() + count <= leaf_capacity) {
+            Leaf *left = leaf(child(par, index - 1));
+            size_t offset = left->keys.size();
+            preserve(left);
+            current->transfer(*left, offset, 0, count);
+            if (next.leaf == current) {
+                next = Position{left, offset + next.index};
+            }
+            remove_leaf(current, trail);
+        } else if (index + 1 < siblings.size() && leaf(child(par, index + 1))->keys.size() + count <= leaf_capacity) {
+            Leaf *right = leaf(child(par, index + 1));
+            preserve(right);
+            current->transfer(*right, 0, 0, count);
+            if (next.leaf == current) {
+                next.leaf = right;
+            } else if (next.leaf == right) {
+                next.index += count;
+            }
+            remove_leaf(current, trail);
+        }
+        return next;
+    }
+
+    void collect_leaves(Node *current, std::vector<Node *> &leaves) const {
+        if (current->children.empty()) {
+            leaves.push_back(current);
+            return;
+        }
+        for (NodeId element: current->children) {
+            collect_leaves(node(element), leaves);
+        }
+    }
+
+    // Returns the internal nodes under root to the arena and leaves its leaves alone.
+    void free_branches(Node *current) {
+        if (current->children.empty()) {
+            return;
+        }
+        for (NodeId element: current->children) {
+            free_branches(node(element));
+        }
+        free_node(current);
+    }
+
+    size_t count_keys(Node *root) const {
+        size_t count = 0;
+        Trail trail;
+        for (Node *now = leftmost(root, trail); now != nullptr; now = next_leaf(now, trail)) {
+            count += leaf(now)->keys.size();
+        }
+        return count;
+    }
+
+    // Calls f(first, last) with the keys of every leaf in order.
+    template<class F>
+    void for_each_run(F f) const {
+        if (arena_ == nullptr) {
+            f(inline_.keys.data(), inline_.keys.data() + size_);
+            return;
+        }
+        Trail trail;
+        for (Node *now = leftmost(root(), trail); now != nullptr; now = next_leaf(now, trail)) {
+            const std::vector<T> &keys = leaf(now)->keys;
+            f(keys.data(), keys.data() + keys.size());
+        }
+    }
+
+    // Builds a tree bottom-up over sorted leaves in O(n): each level is cut into nodes of three
+    // children, ending with one or two nodes of two.
+    Node *build_from_leaves(std::vector<Node *> level) {
+        if (level.empty()) {
+            return nullptr;
+        }
+        while (level.size() > 1) {
+            size_t groups = (level.size() + 2) / 3;
+            size_t pairs = 3 * groups - level.size();
+            std::vector<Node *> next;
+            next.reserve(groups);
+            auto it = level.begin();
+            for (size_t i = 0; i < groups; ++i) {
+                Branch *group = new_branch();
+                size_t count = i + pairs >= groups ? 2 : 3;
+                for (; count > 0; --count, ++it) {
+                    group->children.push_back((*it)->id);
+                }
+                update_node(group);
+                next.push_back(group);
+            }
+            level.swap(next);
+        }
+        set_parent(level[0], no_node);
+        return level[0];
+    }
+
+    // Removes every entry satisfying pred, evaluating pred over threads chunks of the leaves in
+    // parallel. Each leaf is compacted in place. With few removals, emptied leaves are unlinked
+    // one by one; once more than rebuild_fraction of the entries go, the surviving leaves are
+    // packed together and relinked into a fresh tree in one linear pass instead.
+    template<class Pred>
+    size_t erase_if_in_tree(Pred &pred, double rebuild_fraction, size_t threads) {
+        if (arena_ == nullptr) {
+            std::vector<char> doomed(size_);
+            for (size_t j = 0; j < size_; ++j) {
+                doomed[j] = pred(Access::template get<true>(&inline_, j)) ? 1 : 0;
+            }
+            size_t erased = std::count(doomed.begin(), doomed.end(), 1);
+            inline_.remove_marked(doomed.data());
+            size_ -= erased;
+            return erased;
+        }
+        std::vector<Node *> leaves;
+        collect_leaves(root(), leaves);
+        std::vector<size_t> offsets(leaves.size() + 1, 0);
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            offsets[i + 1] = offsets[i] + leaf(leaves[i])->keys.size();
+        }
+        std::vector<char> doomed(size_);
+        auto evaluate = [&](size_t from, size_t to) {
+            for (size_t i = from; i < to; ++i) {
+                for (size_t j = 0; j < leaf(leaves[i])->keys.size(); ++j) {
+                    doomed[offsets[i] + j] = pred(Access::template get<true>(leaf(leaves[i]), j)) ? 1 : 0;
+                }
+            }
+        };
+        threads = std::max<size_t>(1, std::min(threads, leaves.size()));
+        size_t chunk = (leaves.size() + threads - 1) / threads;
+        std::vector<std::thread> workers;
+        for (size_t from = chunk; from < leaves.size(); from += chunk) {
+            workers.emplace_back(evaluate, from, std::min(from + chunk, leaves.size()));
+        }
+        evaluate(0, chunk);
+        for (auto &worker: workers) {
+            worker.join();
+        }
+
+        size_t erased = std::count(doomed.begin(), doomed.end(), 1);
+        if (erased == 0) {
+            return 0;
+        }
+        size_ -= erased;
+        if (erased <= rebuild_fraction * doomed.size()) {
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                Leaf *current = leaf(leaves[i]);
+                if (std::find(doomed.begin() + offsets[i], doomed.begin() + offsets[i + 1], 1) ==
+                    doomed.begin() + offsets[i + 1]) {
+                    continue;
+                }
+                bool last_doomed = doomed[offsets[i + 1] - 1] != 0;
+                Trail trail = trail_to(current);
+                preserve(current);
+                current->remove_marked(doomed.data() + offsets[i]);
+                if (current->keys.empty()) {
+                    remove_leaf(current, trail);
+                } else if (last_doomed) {
+                    update_max_above(current, trail);
+                }
+            }
+            settle(Position{nullptr, 0});
+            return erased;
+        }
+        free_branches(root());
+        size_t kept = 0;
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            Leaf *current = leaf(leaves[i]);
+            preserve(current);
+            current->remove_marked(doomed.data() + offsets[i]);
+            if (current->keys.empty()) {
+                free_node(current);
+                continue;
+            }
+            if (kept > 0 && leaf(leaves[kept - 1])->keys.size() + current->keys.size() <= leaf_capacity) {
+                Leaf *previous = leaf(leaves[kept - 1]);
+                current->transfer(*previous, previous->keys.size(), 0, current->keys.size());
+                free_node(current);
+                continue;
+            }
+            leaves[kept++] = leaves[i];
+        }
+        leaves.resize(kept);
+        arena_->root = build_from_leaves(std::move(leaves));
+        arena_->last = nullptr;
+        settle(Position{nullptr, 0});
+        return erased;
+    }
+
+    // Moves the subtree under root, a node of from's arena, into this tree's arena and returns
+    // its new root. Leaves hand over their entries without copying them; from gets its slots
+    // back.
+    Node *adopt_subtree(TwoThreeTree &from, Node *root) {
+        Node *copy;
+        if (root->children.empty()) {
+            Leaf *moved = new_leaf();
+            from.preserve(root);
+            static_cast<LeafEntries<T, Value> &>(*moved) = std::move(*leaf(root));
+            copy = moved;
+        } else {
+            Branch *moved = new_branch();
+            for (NodeId element: root->children) {
+                Node *adopted = adopt_subtree(from, from.node(element));
+                set_parent(adopted, moved->id);
+                moved->children.push_back(adopted->id);
+            }
+            moved->max_l = branch(root)->max_l;
+            moved->max_mid = branch(root)->max_mid;
+            copy = moved;
+        }
+        from.free_node(root);
+        return copy;
+    }
+
+    // Moves every entry of from into this tree's arena and returns the root they hang under;
+    // from is left empty and without an arena.
+    Node *adopt_tree(TwoThreeTree &from) {
+        Node *root;
+        if (from.arena_ == nullptr) {
+            Leaf *moved = new_leaf();
+            from.inline_.transfer(*moved, 0, 0, from.size_);
+            root = moved;
+        } else {
+            root = adopt_subtree(from, from.root());
+            from.arena_.reset();
+        }
+        from.size_ = 0;
+        return root;
+    }
+
+    size_t height(Node *now) const {
+        size_t result = 0;
+        for (; !now->children.empty(); now = child(now, 0)) {
+            result++;
+        }
+        return result;
+    }
+
+    // Joins two detached subtrees where every key of left is less than every key of right and
+    // returns the new subtree root. Walks O(|height(left) - height(right)| + 1) nodes down and up,
+    // plus the descents to the leaves that the separators of the nodes touched are read from.
+    std::pair<Node *, size_t> join_nodes(Node *left, size_t left_height, Node *right, size_t right_height) {
+        if (left == nullptr) {
+            return std::make_pair(right, right_height);
+        }
+        if (right == nullptr) {
+            return std::make_pair(left, left_height);
+        }
+        if (left_height == right_height) {
+            make_new_root(left, right);
+            return std::make_pair(root(), left_height + 1);
+        }
+        Node *top = left_height > right_height ? left : right;
+        Node *now = top;
+        Trail trail;
+        if (left_height > right_height) {
+            for (size_t h = left_height; h > right_height + 1; --h) {
+                trail.push(now);
+                now = node(now->children.back());
+            }
+        } else {
+            for (size_t h = right_height; h > left_height + 1; --h) {
+                trail.push(now);
+                now = child(now, 0);
+            }
+        }
+        arena_->root = top;
+        if (left_height > right_height) {
+            now->children.push_back(right->id);
+        } else {
+            now->children.insert(now->children.begin(), left->id);
+        }
+        update_node(now);
+        go_up(now, trail);
+        size_t top_height = std::max(left_height, right_height);
+        return std::make_pair(root(), root() == top ? top_height : top_height + 1);
+    }
+
+    TwoThreeTree() = default;
+
+    TwoThreeTree(const TwoThreeTree &st)
+            : inline_(st.inline_), size_(st.size_), arena_(st.arena_ == nullptr ? nullptr : new Arena(*st.arena_)) {
+    }
+
+    // The arena changes hands as it is, so iterators into it stay valid; only the entries of the
+    // inline leaf move, and with them iterators into a small tree are invalidated.
+    TwoThreeTree(TwoThreeTree &&st) noexcept
+            : inline_(std::move(st.inline_)), size_(st.size_), arena_(std::move(st.arena_)) {
+        st.inline_.erase(0, st.inline_.keys.size());
+        st.size_ = 0;
+    }
+
+    TwoThreeTree &operator=(const TwoThreeTree &st) {
+        if (this == &st) {
+            return *this;
+        }
+        TwoThreeTree copy(st);
+        swap(copy);
+        return *this;
+    }
+
+    TwoThreeTree &operator=(TwoThreeTree &&st) noexcept {
+        swap(st);
+        return *this;
+    }
+
+    ~TwoThreeTree() = default;
+
+    void swap(TwoThreeTree &st) noexcept {
+        std::swap(inline_, st.inline_);
+        std::swap(size_, st.size_);
+        arena_.swap(st.arena_);
+    }
+
+    // Cuts the detached tree under root into the keys less than element and the rest, in
+    // O(log^2 n). The leaf element falls into is divided between the two sides. The arena's root
+    // is used as scratch.
+    std::pair<Node *, Node *> split_nodes(Node *root, const T &element) {
+        if (root == nullptr) {
+            return std::make_pair(nullptr, nullptr);
+        }
+        std::vector<std::pair<Node *, size_t>> left_parts, right_parts;
+        size_t now_height = height(root);
+        Node *now = root;
+        while (!now->children.empty()) {
+            size_t index = 0;
+            if (now->children.size() == 3 && branch(now)->max_mid < element) {
+                index = 2;
+            } else if (branch(now)->max_l < element) {
+                index = 1;
+            }
+            for (size_t i = 0; i < index; ++i) {
+                set_parent(child(now, i), no_node);
+                left_parts.emplace_back(child(now, i), now_height - 1);
+            }
+            for (size_t i = now->children.size() - 1; i > index; --i) {
+                set_parent(child(now, i), no_node);
+                right_parts.emplace_back(child(now, i), now_height - 1);
+            }
+            Node *next = child(now, index);
+            set_parent(next, no_node);
+            free_node(now);
+            now = next;
+            now_height--;
+        }
+        Leaf *bottom = leaf(now);
+        size_t index = lower_index(bottom->keys, element);
+        if (index == bottom->keys.size()) {
+            left_parts.emplace_back(now, 0);
+        } else if (index == 0) {
+            right_parts.emplace_back(now, 0);
+        } else {
+            Leaf *upper = new_leaf();
+            preserve(bottom);
+            bottom->transfer(*upper, 0, index, bottom->keys.size() - index);
+            left_parts.emplace_back(now, 0);
+            right_parts.emplace_back(upper, 0);
+        }
+
+        std::pair<Node *, size_t> left_tree(nullptr, 0), right_tree(nullptr, 0);
+        for (auto it = left_parts.rbegin(); it != left_parts.rend(); ++it) {
+            left_tree = join_nodes(it->first, it->second, left_tree.first, left_tree.second);
+        }
+        for (auto it = right_parts.rbegin(); it != right_parts.rend(); ++it) {
+            right_tree = join_nodes(right_tree.first, right_tree.second, it->first, it->second);
+        }
+        return std::make_pair(left_tree.first, right_tree.first);
+    }
+
+    // Moves every key not less than element into right, which must be empty, in O(log^2 n) plus
+    // a walk over the nodes moved, which change arenas and have their keys counted.
+    void split_off_into(TwoThreeTree &right, const T &element) {
+        if (arena_ == nullptr) {
+            size_t index = lower_index(inline_.keys, element);
+            inline_.transfer(right.inline_, 0, index, size_ - index);
+            right.size_ = size_ - index;
+            size_ = index;
+            return;
+        }
+        arena_->last = nullptr;
+        std::pair<Node *, Node *> parts = split_nodes(root(), element);
+        arena_->root = parts.first;
+        if (parts.second != nullptr) {
+            Node *moved = right.adopt_subtree(*this, parts.second);
+            right.arena_->root = moved;
+            right.size_ = right.count_keys(moved);
+        }
+        size_ -= right.size_;
+        settle(Position{nullptr, 0});
+        right.settle(Position{nullptr, 0});
+    }
+
+    // Removes the keys in [lo, hi), or every key from lo on when hi is nullptr, by cutting them
+    // out with two splits and joining what is left, in O(log^2 n). Only counting the removed keys
+    // walks their leaves; their nodes are parked instead of being torn down here. A later call
+    // frees them once their entries outnumber half of the live ones, so beyond the range it just
+    // cut, the graveyard never holds more than that.
+    size_t erase_range_in_tree(const T &lo, const T *hi) {
+        if (hi != nullptr && !(lo < *hi)) {
+            return 0;
+        }
+        if (arena_ == nullptr) {
+            size_t from = lower_index(inline_.keys, lo);
+            size_t to = hi != nullptr ? lower_index(inline_.keys, *hi) : size_;
+            inline_.erase(from, to);
+            size_ -= to - from;
+            return to - from;
+        }
+        if (arena_->parked > size_ / 2) {
+            reclaim_nodes();
+        }
+        // Either bound may be a key of the tree, and the cut at lo can move hi to another leaf.
+        T upper = hi != nullptr ? *hi : lo;
+        arena_->last = nullptr;
+        std::pair<Node *, Node *> left = split_nodes(root(), lo);
+        std::pair<Node *, Node *> rest(left.second, nullptr);
+        if (hi != nullptr) {
+            rest = split_nodes(left.second, upper);
+        }
+        arena_->root = nullptr;
+        if (left.first != nullptr && rest.second != nullptr) {
+            arena_->root = join_nodes(left.first, height(left.first), rest.second, height(rest.second)).first;
+        } else {
+            arena_->root = left.first != nullptr ? left.first : rest.second;
+        }
+        if (rest.first == nullptr) {
+            return 0;
+        }
+        size_t erased = count_keys(rest.first);
+        size_ -= erased;
+        arena_->graveyard.push_back(rest.first->id);
+        arena_->parked += erased;
+        settle(Position{nullptr, 0});
+        return erased;
+    }
+
+    // Frees the subtrees left behind by range erasure in one pass.
+    void reclaim_nodes() {
+        if (arena_ == nullptr) {
+            return;
+        }
+        for (NodeId id: arena_->graveyard) {
+            arena_->release_subtree(node(id));
+        }
+        arena_->graveyard.clear();
+        arena_->parked = 0;
+    }
+
+    // Appends every key of st, which must all be greater than the keys of this tree, in O(log n)
+    // plus moving the smaller of the two trees into the other's arena, which this tree keeps.
+    // Two small trees whose entries fit one inline leaf together are merged there.
+    void join_tree(TwoThreeTree &st) {
+        if (st.size_ == 0) {
+            return;
+        }
+        if (size_ == 0) {
+            swap(st);
+            return;
+        }
+        if (arena_ == nullptr && st.arena_ == nullptr && size_ + st.size_ <= inline_capacity) {
+            st.inline_.transfer(inline_, size_, 0, st.size_);
+            size_ += st.size_;
+            st.size_ = 0;
+            return;
+        }
+        size_t total = size_ + st.size_;
+        Node *left, *right;
+        if (st.size_ <= size_) {
+            spill_inline();
+            left = root();
+            right = adopt_tree(st);
+        } else {
+            st.spill_inline();
+            right = st.root();
+            left = st.adopt_tree(*this);
+            arena_.swap(st.arena_);
+        }
+        arena_->root = join_nodes(left, height(left), right, height(right)).first;
+        arena_->last = nullptr;
+        size_ = total;
+        st.size_ = 0;
+    }
+
+    // Holds the entries of a tree without an arena, see spill_inline; empty otherwise.
+    InlineLeaf inline_;
+
+    size_t size_ = 0;
+
+    // The nodes of a tree that outgrew inline_, or nullptr while it fits there.
+    std::unique_ptr<Arena> arena_;
+
+public:
+    // Trivially copyable bidirectional iterator: a raw leaf pointer and an index into the leaf,
+    // plus the arena the leaf belongs to, which links it to its neighbours and is null for the
+    // inline leaf. Steps within a leaf are an increment; only crossing into the next leaf walks
+    // the tree. The end of a tree with an arena is a null leaf; the end of a small tree is the
+    // index one past its last entry. Without ParentLinks the iterator also carries the trail of
+    // its leaf, held as an empty base so that it costs nothing with them.
+    template<bool Const>
+    class basic_iterator : private Trail {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = typename Access::value_type;
+        using difference_type = std::ptrdiff_t;
+        using reference = typename Access::template reference<Const>;
+        using pointer = typename Access::template pointer<Const>;
+
+        basic_iterator() = default;
+
+        template<bool OtherConst, class = typename std::enable_if<Const && !OtherConst>::type>
+        basic_iterator(const basic_iterator<OtherConst> &it)
+                : Trail(it.trail()), current_(it.current_), index_(it.index_), arena_(it.arena_) {}
+
+        reference operator*() const {
+            if (arena_ == nullptr) {
+                return Access::template get<Const>(inline_leaf(), index_);
+            }
+            return Access::template get<Const>(static_cast<Leaf *>(current_), index_);
+        }
+
+        pointer operator->() const {
+            if (arena_ == nullptr) {
+                return Access::template arrow<Const>(inline_leaf(), index_);
+            }
+            return Access::template arrow<Const>(static_cast<Leaf *>(current_), index_);
+        }
+
+        basic_iterator &operator++() {
+            if (++index_ == leaf_size() && arena_ != nullptr) {
+                current_ = arena_->next_leaf(current_, trail());
+                index_ = 0;
+            }
+            return *this;
+        }
+
+        basic_iterator &operator--() {
+            if (current_ == nullptr || index_ == 0) {
+                current_ = current_ == nullptr ? arena_->rightmost(arena_->root, trail())
+                                               : arena_->prev_leaf(current_, trail());
+                index_ = static_cast<Leaf *>(current_)->keys.size();
+            }
+            --index_;
+            return *this;
+        }
+
+        basic_iterator operator++(int) {
+            basic_iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        basic_iterator operator--(int) {
+            basic_iterator it = *this;
+            --*this;
+            return it;
+        }
+
+        template<bool OtherConst>
+        bool operator==(const basic_iterator<OtherConst> &it) const {
+            return current_ == it.current_ && index_ == it.index_;
+        }
+
+        template<bool OtherConst>
+        bool operator!=(const basic_iterator<OtherConst> &it) const {
+            return !(*this == it);
+        }
+
+    private:
+        friend class TwoThreeTree;
+
+        template<bool>
+        friend class basic_iterator;
+
+        basic_iterator(Node *current, size_t index, const Arena *arena, const Trail &trail)
+                : Trail(trail), current_(current), index_(index), arena_(arena) {}
+
+        Trail &trail() {
+            return *this;
+        }
+
+        const Trail &trail() const {
+            return *this;
+        }
+
+        // Without an arena the iterator is in the inline leaf of a small tree.
+        InlineLeaf *inline_leaf() const {
+            return static_cast<InlineLeaf *>(current_);
+        }
+
+        size_t leaf_size() const {
+            return arena_ == nullptr ? inline_leaf()->keys.size() : static_cast<Leaf *>(current_)->keys.size();
+        }
+
+        const T &key() const {
+            return arena_ == nullptr ? inline_leaf()->keys[index_] : static_cast<Leaf *>(current_)->keys[index_];
+        }
+
+        Node *current_ = nullptr;
+        size_t index_ = 0;
+        const Arena *arena_ = nullptr;
+    };
+
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    // Drops every entry at once. The arena goes away block by block: internal nodes are not
+    // visited at all when T is trivially destructible, and leaves only give back their entry
+    // arrays in one sweep, so nothing recurses or walks the tree. The destructor does the same.
+    void clear() {
+        arena_.reset();
+        inline_.erase(0, inline_.keys.size());
+        size_ = 0;
+    }
+
+    iterator begin() {
+        return make<false>(static_cast<const TwoThreeTree *>(this)->begin());
+    }
+
+    const_iterator begin() const {
+        Trail trail;
+        return make<true>(Position{arena_ == nullptr ? inline_leaf() : leftmost(root(), trail), 0}, trail);
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    iterator end() {
+        return make<false>(Position{nullptr, 0}, Trail());
+    }
+
+    const_iterator end() const {
+        return make<true>(Position{nullptr, 0}, Trail());
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    reverse_iterator rbegin() {
+        return reverse_iterator(end());
+    }
+
+    const_reverse_iterator rbegin() const {
+        return const_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rend() const {
+        return const_reverse_iterator(begin());
+    }
+
+    iterator find(const T &element) {
+        return make<false>(static_cast<const TwoThreeTree *>(this)->find(element));
+    }
+
+    const_iterator find(const T &element) const {
+        Trail trail;
+        Position pos = find_position(element, trail);
+        return make<true>(pos, trail);
+    }
+
+    iterator lower_bound(const T &element) {
+        return make<false>(static_cast<const TwoThreeTree *>(this)->lower_bound(element));
+    }
+
+    const_iterator lower_bound(const T &element) const {
+        Trail trail;
+        Position pos = lower_position(element, trail);
+        return make<true>(pos, trail);
+    }
+
+    iterator upper_bound(const T &element) {
+        return make<false>(static_cast<const TwoThreeTree *>(this)->upper_bound(element));
+    }
+
+    const_iterator upper_bound(const T &element) const {
+        const_iterator found = lower_bound(element);
+        if (found != end() && !(element < found.key())) {
+            ++found;
+        }
+        return found;
+    }
+
+    std::pair<iterator, iterator> equal_range(const T &element) {
+        std::pair<const_iterator, const_iterator> range = static_cast<const TwoThreeTree *>(this)->equal_range(element);
+        return std::make_pair(make<false>(range.first), make<false>(range.second));
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const T &element) const {
+        const_iterator found = lower_bound(element);
+        if (found == end() || element < found.key()) {
+            return std::make_pair(found, found);
+        }
+        return std::make_pair(found, std::next(found));
+    }
+
+    // Finger search: climbs from hint only as far as needed, so a key d positions away costs
+    // O(log d). Returns end() if element is absent.
+    iterator find_near(const_iterator hint, const T &element) {
+        return make<false>(static_cast<const TwoThreeTree *>(this)->find_near(hint, element));
+    }
+
+    const_iterator find_near(const_iterator hint, const T &element) const {
+        if (arena_ == nullptr) {
+            return find(element);
+        }
+        Hint from = hint_leaf(hint);
+        Position pos = exact_position(find_vertex_near(from.leaf, from.trail, element), from.trail, element);
+        return make<true>(pos, from.trail);
+    }
+
+protected:
+    // An iterator at pos, whose leaf has the ancestors trail holds.
+    template<bool Const>
+    basic_iterator<Const> make(Position pos, const Trail &trail) const {
+        if (arena_ == nullptr) {
+            return basic_iterator<Const>(inline_leaf(), pos.leaf == nullptr ? size_ : pos.index, nullptr, trail);
+        }
+        return basic_iterator<Const>(pos.leaf, pos.index, arena_.get(), trail);
+    }
+
+    // Same, for a position without its trail, which is looked up again without ParentLinks.
+    template<bool Const>
+    basic_iterator<Const> make(Position pos) const {
+        return make<Const>(pos, pos.leaf == nullptr ? Trail() : trail_to(pos.leaf));
+    }
+
+    // The iterator at the same entry as it.
+    template<bool Const>
+    basic_iterator<Const> make(const_iterator it) const {
+        return basic_iterator<Const>(it.current_, it.index_, it.arena_, it.trail());
+    }
+
+    iterator make_iterator(Position pos) {
+        return make<false>(pos);
+    }
+
+    // The end of a small tree, one past the entries of its inline leaf, comes back as the null
+    // position like the end of any other tree.
+    static Position position(const_iterator it) {
+        if (it.current_ != nullptr && it.index_ == it.leaf_size()) {
+            return Position{nullptr, 0};
+        }
+        return Position{it.current_, it.index_};
+    }
+
+    // The leaf of hint to start a finger search from, or nullptr to start from the root when
+    // hint is the end or was taken before the tree moved its entries into its arena.
+    Hint hint_leaf(const_iterator hint) const {
+        Node *start = hint.arena_ == arena_.get() ? position(hint).leaf : nullptr;
+        return Hint{start, start == nullptr ? Trail() : hint.trail()};
+    }
+
+    // The trail an iterator carries for its leaf.
+    static Trail trail_of(const_iterator it) {
+        return it.trail();
+    }
+
+    static Leaf *leaf(const_iterator it) {
+        return static_cast<Leaf *>(it.current_);
+    }
+
+    decltype(auto) value(Position pos) {
+        return arena_ == nullptr ? inline_.value(pos.index) : leaf(pos.leaf)->value(pos.index);
+    }
+
+    static decltype(auto) value(const_iterator it) {
+        return it.arena_ == nullptr ? it.inline_leaf()->value(it.index_) : leaf(it)->value(it.index_);
+    }
+};
 
-private:
-    struct Node {
-        std::vector<std::shared_ptr<Node>> children;
-        std::shared_ptr<Node> par;
-        T max_l, max_mid, max;
+template<class T, class Value, class Access, bool ParentLinks>
+constexpr size_t TwoThreeTree<T, Value, Access, ParentLinks>::leaf_capacity;
 
-        Node() = default;
+template<class T, class Value, class Access, bool ParentLinks>
+constexpr size_t TwoThreeTree<T, Value, Access, ParentLinks>::inline_capacity;
 
-        Node(T key) {
-            max_l = key;
-            max = key;
-        }
+template<class T, class Value, class Access, bool ParentLinks>
+constexpr size_t TwoThreeTree<T, Value, Access, ParentLinks>::max_height;
 
-        ~Node() = default;
-    };
+// Immutable sorted set for read-mostly phases, produced by Set::freeze. The keys sit in one
+// contiguous array in Eytzinger order: the root of an implicit balanced search tree at index 1
+// and the children of index k at 2k and 2k + 1. The first levels, which every search walks, share
+// a few cache lines, and a search is a fixed number of branch-free steps that prefetch the
+// descendants a few levels below, so misses overlap instead of queueing up one per level.
+// Iterators are indices into the array and step in key order.
+template<class T>
+class FrozenSet {
 
-    bool is_equal(const T &element1, const T &element2) const {
-        return !(element1 < element2) && !(element2 < element1);
+private:
+    // Descendants lookahead levels below index k start at index k * lookahead and fill one cache
+    // line.
+    static constexpr size_t floor_power_of_two(size_t value) {
+        size_t result = 1;
+        while (result * 2 <= value) {
+            result *= 2;
+        }
+        return result;
     }
 
-    std::shared_ptr<Node> find_vertex(const std::shared_ptr<Node> &now, const T &key) const {
-        if (now == nullptr) {
-            return nullptr;
+    static constexpr size_t lookahead = floor_power_of_two(sizeof(T) < 64 ? 64 / sizeof(T) : 1);
+
+    // Undoes the final descent past a leaf of the implicit tree: drops the trailing right turns
+    // and one left turn, landing on the last node where the search went left, or 0 if none.
+    static size_t climb_past_right_turns(size_t k) {
+#if defined(__GNUC__)
+        return k >> (__builtin_ctzll(~static_cast<unsigned long long>(k)) + 1);
+#else
+        while (k & 1) {
+            k >>= 1;
         }
-        if (now->children.empty()) {
-            return now;
+        return k >> 1;
+#endif
+    }
+
+    size_t first_index() const {
+        if (size_ == 0) {
+            return 0;
         }
-        if (now->children.size() == 2) {
-            if (now->max_l < key) {
-                return find_vertex(now->children[1], key);
-            } else {
-                return find_vertex(now->children[0], key);
-            }
-        } else {
-            if (now->max_mid < key) {
-                return find_vertex(now->children[2], key);
-            } else if (now->max_l < key) {
-                return find_vertex(now->children[1], key);
-            } else {
-                return find_vertex(now->children[0], key);
-            }
+        size_t k = 1;
+        while (2 * k <= size_) {
+            k = 2 * k;
         }
+        return k;
     }
 
-    void make_new_root(const std::shared_ptr<Node> &node1, const std::shared_ptr<Node> &node2) {
-        std::shared_ptr<Node> new_root = std::make_shared<Node>();
-        if (node2->max_l < node1->max_l) {
-            new_root->max_l = node2->max_l;
-            new_root->children.push_back(node2);
-            new_root->children.push_back(node1);
-        } else {
-            new_root->max_l = node1->max_l;
-            new_root->children.push_back(node1);
-            new_root->children.push_back(node2);
+    size_t last_index() const {
+        if (size_ == 0) {
+            return 0;
         }
-        new_root->max = std::max(new_root->children[0]->max, new_root->children[1]->max);
-        node1->par = new_root;
-        node2->par = new_root;
-        root_ = new_root;
+        size_t k = 1;
+        while (2 * k + 1 <= size_) {
+            k = 2 * k + 1;
+        }
+        return k;
     }
 
-    static bool comparator_children(const std::shared_ptr<Node> &child1, const std::shared_ptr<Node> &child2) {
-        return (child1->max_l < child2->max_l);
+    size_t next_index(size_t k) const {
+        if (2 * k + 1 <= size_) {
+            k = 2 * k + 1;
+            while (2 * k <= size_) {
+                k = 2 * k;
+            }
+            return k;
+        }
+        return climb_past_right_turns(k);
     }
 
-    void update_node(const std::shared_ptr<Node> &node) {
-        if (node == nullptr) {
-            return;
-        }
-        if (node->children.empty()) {
-            return;
+    size_t prev_index(size_t k) const {
+        if (k == 0) {
+            return last_index();
         }
-        sort(node->children.begin(), node->children.end(), comparator_children);
-        node->max_l = node->children[0]->max;
-        node->max = node->max_l;
-        for (auto &element: node->children) {
-            element->par = node;
-            if (node->max < element->max) {
-                node->max = element->max;
+        if (2 * k <= size_) {
+            k = 2 * k;
+            while (2 * k + 1 <= size_) {
+                k = 2 * k + 1;
             }
+            return k;
         }
-        if (node->children.size() > 2) {
-            node->max_mid = node->children[1]->max;
+        while (k != 0 && (k & 1) == 0) {
+            k >>= 1;
         }
+        return k >> 1;
     }
 
-    void global_update(const std::shared_ptr<Node> &node) {
-        if (node == nullptr) {
-            return;
+    // Walks the implicit tree turning right while keys compare below element (or, with Upper,
+    // not above it), then returns the last node where it turned left.
+    template<bool Upper>
+    size_t search(const T &element) const {
+        const T *keys = keys_.data();
+        size_t k = 1;
+        while (k <= size_) {
+#if defined(__GNUC__)
+            __builtin_prefetch(keys + std::min(k * lookahead, size_));
+#endif
+            k = 2 * k + (Upper ? !(element < keys[k]) : keys[k] < element);
         }
-        update_node(node);
-        global_update(node->par);
+        return climb_past_right_turns(k);
     }
 
-    void join_child_to_parent(const std::shared_ptr<Node> &par, const std::shared_ptr<Node> &child) {
-        par->children.push_back(child);
-        child->par = par;
-        update_node(par);
-    }
+    // Index 0 is unused, so that the children of k are 2k and 2k + 1.
+    std::vector<T> keys_;
+    size_t size_ = 0;
 
-    std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> split(const std::shared_ptr<Node> &node) {
-        update_node(node);
-        std::shared_ptr<Node> left = std::make_shared<Node>();
-        std::shared_ptr<Node> right = std::make_shared<Node>();
-        left->children.push_back(node->children[0]);
-        left->children.push_back(node->children[1]);
-        right->children.push_back(node->children[2]);
-        right->children.push_back(node->children[3]);
-        left->children[0]->par = left;
-        left->children[1]->par = left;
-        right->children[0]->par = right;
-        right->children[1]->par = right;
-        update_node(left);
-        update_node(right);
-        return make_pair(left, right);
-    }
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using reference = const T &;
+        using pointer = const T *;
 
-    void go_up(const std::shared_ptr<Node> &node) {
-        if (node == nullptr) {
-            return;
-        }
-        if (node->children.size() < 4) {
-            return;
-        }
-        std::shared_ptr<Node> parent = node->par;
-        std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> pnn = split(node);
-        if (parent == nullptr) {
-            std::shared_ptr<Node> new_root = std::make_shared<Node>();
-            new_root->children.push_back(pnn.first);
-            new_root->children.push_back(pnn.second);
-            pnn.first->par = new_root;
-            pnn.second->par = new_root;
-            root_ = new_root;
-            update_node(root_);
-        } else {
-            parent->children.erase(std::find(parent->children.begin(), parent->children.end(), node));
-            parent->children.push_back(pnn.first);
-            parent->children.push_back(pnn.second);
-            pnn.first->par = parent;
-            pnn.second->par = parent;
-            update_node(parent);
-            go_up(parent);
-        }
-    }
+        const_iterator() = default;
 
-    void insert_to_tree(const T &key) {
-        std::shared_ptr<Node> found = find_vertex(root_, key);
-        std::shared_ptr<Node> new_ver = std::make_shared<Node>(key);
-        if (found == nullptr) {
-            size_++;
-            root_ = new_ver;
-            return;
-        }
-        if (is_equal(found->max_l, key)) {
-            return;
+        reference operator*() const {
+            return owner_->keys_[index_];
         }
-        size_++;
-        if (found->par == nullptr) {
-            make_new_root(root_, new_ver);
-            return;
+
+        pointer operator->() const {
+            return &owner_->keys_[index_];
         }
-        join_child_to_parent(found->par, new_ver);
-        go_up(found->par);
-        global_update(found->par);
-    }
 
-    std::shared_ptr<Node> get_uncle(const std::shared_ptr<Node> &current) {
-        if (current->par == nullptr) {
-            return nullptr;
+        const_iterator &operator++() {
+            index_ = owner_->next_index(index_);
+            return *this;
         }
-        std::shared_ptr<Node> par = current->par;
 
-        if (current != par->children[1]) {
-            return par->children[1];
-        } else {
-            return par->children[0];
+        const_iterator &operator--() {
+            index_ = owner_->prev_index(index_);
+            return *this;
         }
-    }
 
-    void erase_up(const std::shared_ptr<Node> &current) {
-        if (current == nullptr) {
-            return;
+        const_iterator operator++(int) {
+            const_iterator it = *this;
+            ++*this;
+            return it;
         }
-        if (current->children.size() > 1) {
-            return;
+
+        const_iterator operator--(int) {
+            const_iterator it = *this;
+            --*this;
+            return it;
         }
-        std::shared_ptr<Node> par = current->par;
-        std::shared_ptr<Node> brother;
-        if (par == nullptr) {
-            root_ = current->children[0];
-            current->children[0]->par = nullptr;
-            current->children.clear();
-            return;
+
+        bool operator==(const const_iterator &it) const {
+            return index_ == it.index_;
         }
 
-        brother = par->children[1];
-        if (current == brother) {
-            brother = par->children[0];
+        bool operator!=(const const_iterator &it) const {
+            return index_ != it.index_;
         }
 
-        brother->children.push_back(current->children[0]);
-        current->children[0]->par = brother;
+    private:
+        friend class FrozenSet;
+
+        const_iterator(const FrozenSet *owner, size_t index) : owner_(owner), index_(index) {}
+
+        const FrozenSet *owner_ = nullptr;
+        size_t index_ = 0;
+    };
 
-        current->children.clear();
+    using iterator = const_iterator;
 
-        par->children.erase(std::find(par->children.begin(), par->children.end(), current));
-        current->par = nullptr;
+    FrozenSet() : keys_(1) {}
 
-        if (brother->children.size() > 3) {
-            std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> pnn = split(brother);
-            par->children.push_back(pnn.first);
-            par->children.push_back(pnn.second);
-            pnn.first->par = par;
-            pnn.second->par = par;
-            par->children.erase(std::find(par->children.begin(), par->children.end(), brother));
-            brother->children.clear();
-            brother->par = nullptr;
-            update_node(par);
+    // Lays out the keys of [first, last), which must be strictly increasing, by filling the
+    // implicit tree in order.
+    template<class Iterator>
+    FrozenSet(Iterator first, Iterator last) : size_(std::distance(first, last)) {
+        keys_.resize(size_ + 1);
+        for (size_t k = first_index(); k != 0; k = next_index(k)) {
+            keys_[k] = *first++;
         }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
 
-        erase_up(par);
+    const_iterator begin() const {
+        return const_iterator(this, first_index());
+    }
 
+    const_iterator end() const {
+        return const_iterator(this, 0);
     }
 
-    void erase_in_tree(const T &key) {
-        std::shared_ptr<Node> current = find_vertex(root_, key);
-        if (current == nullptr || !is_equal(current->max_l, key)) {
-            return;
+    const_iterator find(const T &element) const {
+        size_t k = search<false>(element);
+        if (k == 0 || element < keys_[k]) {
+            return end();
         }
-        size_--;
-        std::shared_ptr<Node> par = current->par;
-        std::shared_ptr<Node> brother;
-        if (par == nullptr) {
-            root_ = nullptr;
-            current->par = nullptr;
-            return;
+        return const_iterator(this, k);
+    }
+
+    const_iterator lower_bound(const T &element) const {
+        return const_iterator(this, search<false>(element));
+    }
+
+    const_iterator upper_bound(const T &element) const {
+        return const_iterator(this, search<true>(element));
+    }
+};
+
+template<class T>
+constexpr size_t FrozenSet<T>::lookahead;
+
+// Ordered set of unique keys.
+//
+// Iterators, and references and pointers to keys, point into leaves whose keys shift to make
+// room for an insertion or close the gap of an erasure, and which split and merge with their
+// neighbours. Every insert, erase (of any form), erase_range, erase_if, split_off, clear and
+// assignment therefore invalidates all of them, including end(). Moving and swapping a set keeps
+// its leaves where they are, and join keeps those of the larger set, so iterators into them stay
+// valid and follow the keys into the set that now holds them, except for a set of at most
+// inline_capacity keys, which keeps them inside the Set object itself. Lookups, iteration and
+// reclaim invalidate nothing.
+//
+// With ParentLinks = false the nodes keep no parent index and every climb follows the path its
+// descent recorded instead, which saves a word per node and the upkeep of relinking children on
+// every split, merge and rebuild. Iterators then carry that path, so on top of the above they are
+// also invalidated by join and by moves and swaps of the set.
+template<class T, bool ParentLinks = true>
+class Set : public TwoThreeTree<T, void, KeyAccess<T>, ParentLinks> {
+
+private:
+    using Base = TwoThreeTree<T, void, KeyAccess<T>, ParentLinks>;
+
+    // BinaryCodec stores a key as its object representation, so a run of keys already is its
+    // serialized form and goes out, or comes in, with one stream call instead of one per key.
+    template<class Codec>
+    using raw_codec = std::is_same<Codec, BinaryCodec<T>>;
+
+    // Bytes of keys checkpoint gathers before handing them to the file.
+    static constexpr size_t flush_size_ = 1 << 16;
+
+    template<class Codec>
+    static void write_keys(std::ostream &out, const T *first, const T *last, std::true_type) {
+        out.write(reinterpret_cast<const char *>(first), (last - first) * sizeof(T));
+    }
+
+    template<class Codec>
+    static void write_keys(std::ostream &out, const T *first, const T *last, std::false_type) {
+        for (; first != last; ++first) {
+            Codec::write(out, *first);
         }
+    }
 
-        brother = par->children[1];
-        if (current == brother) {
-            brother = par->children[0];
+    // Reads whole leaves at a time, each straight into a fresh leaf of the arena that is then
+    // linked in after the last one, so the load is O(n) and the keys are never buffered anywhere
+    // but in their final leaf.
+    template<class Codec>
+    static void read_keys(std::istream &in, uint64_t count, Set &result, std::true_type) {
+        const T *previous = nullptr;
+        for (uint64_t done = 0; done < count;) {
+            size_t run = static_cast<size_t>(std::min<uint64_t>(Base::leaf_capacity, count - done));
+            typename Base::Leaf *leaf = result.new_leaf();
+            leaf->keys.resize(run);
+            if (!in.read(reinterpret_cast<char *>(leaf->keys.data()), run * sizeof(T))) {
+                result.free_node(leaf);
+                throw std::runtime_error("Set::deserialize");
+            }
+            for (const T &element: leaf->keys) {
+                if (previous != nullptr && !(*previous < element)) {
+                    result.free_node(leaf);
+                    throw std::runtime_error("Set::deserialize");
+                }
+                previous = &element;
+            }
+            result.append_leaf(leaf);
+            result.size_ += run;
+            done += run;
         }
-        par->children.erase(std::find(par->children.begin(), par->children.end(), current));
-        current->par = nullptr;
+        result.settle(typename Base::Position{nullptr, 0});
+    }
 
-        if (par->children.size() > 1) {
-            global_update(par);
-            return;
+    // Keys arrive sorted, so each one is appended straight onto the right spine.
+    template<class Codec>
+    static void read_keys(std::istream &in, uint64_t count, Set &result, std::false_type) {
+        T element;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (!Codec::read(in, element) || (i > 0 && !(result.back_key() < element))) {
+                throw std::runtime_error("Set::deserialize");
+            }
+            result.append_key(element);
         }
+    }
+
+public:
+    Set() = default;
 
-        std::shared_ptr<Node> uncle = get_uncle(par);
+    template<typename Iterator>
 
-        if (uncle == nullptr) {
-            root_ = brother;
-            root_->par = nullptr;
-            root_->children.clear();
-            return;
+    Set(Iterator first, Iterator last) {
+        for (auto it = first; it != last; ++it) {
+            this->insert_to_tree(*it);
         }
-        uncle->children.push_back(brother);
-        par->children.erase(std::find(par->children.begin(), par->children.end(), brother));
-        brother->par = uncle;
-        if (uncle->children.size() > 3) {
-            std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> pnn = split(uncle);
+    }
 
-            uncle->par->children.push_back(pnn.first);
-            uncle->par->children.push_back(pnn.second);
+    Set(std::initializer_list<T> initializer_list) {
+        for (const auto &element: initializer_list) {
+            this->insert_to_tree(element);
+        }
+    }
 
-            pnn.first->par = uncle->par;
-            pnn.second->par = uncle->par;
+    void insert(const T &element) {
+        this->insert_to_tree(element);
+    }
 
-            uncle->par->children.erase(std::find(uncle->par->children.begin(), uncle->par->children.end(), uncle));
+    // Inserts element starting the search from hint instead of the root; cheap when hint is
+    // close to where element belongs.
+    typename Base::iterator insert(typename Base::const_iterator hint, const T &element) {
+        return this->make_iterator(this->insert_near(this->hint_leaf(hint), element).first);
+    }
 
-            update_node(uncle->par);
+    // Appends an element greater than every element in the set in amortized O(1).
+    typename Base::iterator push_back_sorted(const T &element) {
+        assert(this->empty() || this->back_key() < element);
+        return this->make_iterator(this->append_key(element));
+    }
 
-            uncle->par = nullptr;
+    void erase(const T &element) {
+        this->erase_in_tree(element);
+    }
 
-            uncle->children.clear();
+    // Removes the element at pos and returns an iterator to the one after it.
+    typename Base::iterator erase(typename Base::const_iterator pos) {
+        typename Base::Trail trail = Base::trail_of(pos);
+        return this->make_iterator(this->erase_at(Base::position(pos), trail));
+    }
 
+    // Removes the elements of [first, last) in O(log^2 n) plus a walk to count them, and returns
+    // an iterator to the element last pointed to.
+    typename Base::iterator erase(typename Base::const_iterator first, typename Base::const_iterator last) {
+        if (first == last) {
+            return this->make_iterator(Base::position(last));
         }
+        if (last == this->cend()) {
+            this->erase_range_in_tree(*first, nullptr);
+            return this->end();
+        }
+        T hi = *last;
+        this->erase_range_in_tree(*first, &hi);
+        return this->lower_bound(hi);
+    }
 
-        par->par->children.erase(std::find(par->par->children.begin(), par->par->children.end(), par));
+    // Removes the elements in [lo, hi) and returns how many there were.
+    size_t erase_range(const T &lo, const T &hi) {
+        return this->erase_range_in_tree(lo, &hi);
+    }
 
-        std::shared_ptr<Node> next = par->par;
+    // Frees the nodes of ranges erased so far right away instead of on a later erase_range or
+    // on destruction.
+    void reclaim() {
+        this->reclaim_nodes();
+    }
 
-        par->par = nullptr;
-        par->children.clear();
+    // Removes every element satisfying pred and returns how many there were. When more than
+    // rebuild_fraction of the set goes, the tree is rebuilt from the survivors in O(n). With
+    // threads > 1, pred runs concurrently on chunks of the set and must be safe to do so.
+    template<class Pred>
+    size_t erase_if(Pred pred, double rebuild_fraction = 0.1, size_t threads = 1) {
+        return this->erase_if_in_tree(pred, rebuild_fraction, threads);
+    }
 
-        erase_up(next);
-        global_update(brother);
+    // Writes the key count followed by every key in ascending order, a leaf at a time.
+    template<class Codec = BinaryCodec<T>>
+    void serialize(std::ostream &out) const {
+        uint64_t count = this->size_;
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        this->for_each_run([&out](const T *first, const T *last) {
+            write_keys<Codec>(out, first, last, raw_codec<Codec>());
+        });
     }
 
-    void destroy_vertex(const std::shared_ptr<Node> &current) {
-        if (current == nullptr) {
-            return;
-        }
-        if (current->children.empty()) {
-            current->par = nullptr;
-        } else {
-            for (auto &element: current->children) {
-                destroy_vertex(element);
+    // Writes a point-in-time image of the set to path in the serialize format without holding
+    // the caller up for the I/O. The caller only pins the leaves, in O(n / leaf_capacity); a
+    // background thread reads them while the set keeps changing, and a leaf that changes before
+    // it was read is copied first, once (see LeafPin). The image goes through a DurableFile, so
+    // the future only becomes ready once it is on disk under path. progress, when given, counts
+    // the keys written so far.
+    template<class Codec = BinaryCodec<T>>
+    std::future<void> checkpoint(const std::string &path,
+                                 std::shared_ptr<std::atomic<size_t>> progress = nullptr) const {
+        auto pin = this->pin_leaves();
+        uint64_t count = this->size_;
+        return std::async(std::launch::async, [pin, count, path, progress]() {
+            try {
+                DurableFile file(path, "Set::checkpoint");
+                file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+                std::vector<T> keys;
+                std::ostringstream chunk;
+                size_t written = 0;
+                for (size_t i = 0; i < pin->size(); ++i) {
+                    pin->take(i, keys);
+                    write_keys<Codec>(chunk, keys.data(), keys.data() + keys.size(), raw_codec<Codec>());
+                    written += keys.size();
+                    if (chunk.tellp() >= static_cast<std::streamoff>(flush_size_) || i + 1 == pin->size()) {
+                        file.write(chunk.str());
+                        chunk.str(std::string());
+                        if (progress != nullptr) {
+                            progress->store(written, std::memory_order_relaxed);
+                        }
+                    }
+                }
+                file.commit();
+            } catch (...) {
+                pin->abandon();
+                throw;
             }
-            current->par = nullptr;
-            current->children.clear();
+        });
+    }
+
+    // Reads a set written by serialize in O(n), filling the leaves of the result in place.
+    template<class Codec = BinaryCodec<T>>
+    static Set deserialize(std::istream &in) {
+        Set result;
+        uint64_t count = 0;
+        if (!in.read(reinterpret_cast<char *>(&count), sizeof(count))) {
+            throw std::runtime_error("Set::deserialize");
+        }
+        read_keys<Codec>(in, count, result, raw_codec<Codec>());
+        return result;
+    }
+
+    // Returns a key near position fraction * size() of a non-empty set in O(log n). The descent
+    // takes the child the fraction falls into as if sibling subtrees held the same number of keys,
+    // so the rank can be off by a constant factor per level; good enough to pick a split point
+    // for balancing, not an order statistic.
+    const T &approximate_quantile(double fraction) const {
+        assert(!this->empty());
+        fraction = std::min(std::max(fraction, 0.0), 1.0);
+        if (this->arena_ == nullptr) {
+            return this->inline_.keys[std::min(static_cast<size_t>(fraction * this->size_), this->size_ - 1)];
+        }
+        typename Base::Node *now = this->root();
+        while (!now->children.empty()) {
+            size_t count = now->children.size();
+            size_t index = std::min(static_cast<size_t>(fraction * count), count - 1);
+            fraction = fraction * count - index;
+            now = this->child(now, index);
         }
+        const std::vector<T> &keys = Base::leaf(now)->keys;
+        return keys[std::min(static_cast<size_t>(fraction * keys.size()), keys.size() - 1)];
     }
 
-    std::shared_ptr<Node> root_;
+    // Copies the keys into an immutable FrozenSet laid out for fast lookups, in O(n).
+    FrozenSet<T> freeze() const {
+        return FrozenSet<T>(this->begin(), this->end());
+    }
 
-    size_t size_ = 0;
+    void swap(Set &st) noexcept {
+        Base::swap(st);
+    }
+
+    // Moves every key not less than element into the returned set in O(log^2 n), plus moving the
+    // nodes that change sets over to its arena. Iterators into the moved part are invalidated.
+    Set split_off(const T &element) {
+        Set right;
+        this->split_off_into(right, element);
+        return right;
+    }
+
+    // Appends every key of st, which must all be greater than the keys of this set, in O(log n),
+    // plus moving the nodes of the smaller set into the arena of the larger one. Iterators into
+    // the larger set stay valid unless it was small enough to keep its keys inline.
+    void join(Set &st) {
+        this->join_tree(st);
+    }
+};
+
+template<class T, bool ParentLinks, class Pred>
+size_t erase_if(Set<T, ParentLinks> &set, Pred pred) {
+    return set.erase_if(pred);
+}
+
+// Ordered map on the same engine: lookups, insertion and in-place updates all resolve in a
+// single descent to the key's leaf.
+//
+// Keys are invalidated like in Set: iterators and references to keys are invalidated by every
+// operation that changes the map, except that moves, swaps and join keep those into a map with
+// nodes of its own valid. Each entry is a pair<const K, V> allocated on its own, so references
+// and pointers to an entry or its value, such as the one operator[] returns, stay valid until the
+// entry is erased or the map is cleared or assigned to, whatever happens to the other entries
+// and across moves and swaps of the map. An entry that split_off or join hands to another map
+// takes its pair along.
+template<class K, class V>
+class Map : public TwoThreeTree<K, Boxed<std::pair<const K, V>>, EntryAccess<K, V>> {
+
+private:
+    using Base = TwoThreeTree<K, Boxed<std::pair<const K, V>>, EntryAccess<K, V>>;
 
 public:
-    class iterator {
-    public:
-        bool is_end = false;
+    using typename Base::iterator;
+    using value_type = std::pair<const K, V>;
 
-        iterator() : is_end(true) {}
+    Map() = default;
 
-        iterator(std::shared_ptr<Node> node) {
-            current_ = node;
-            is_end = (current_ == nullptr);
+    Map(std::initializer_list<value_type> initializer_list) {
+        for (const auto &element: initializer_list) {
+            this->insert_to_tree(element.first, element);
         }
+    }
 
-        ~iterator() = default;
+    V &operator[](const K &key) {
+        return Base::value(this->insert_to_tree(key, std::piecewise_construct, std::forward_as_tuple(key),
+                                                std::forward_as_tuple()).first).second;
+    }
 
-        const T &operator*() {
-            return current_->max_l;
-        }
+    V &at(const K &key) {
+        return const_cast<V &>(static_cast<const Map *>(this)->at(key));
+    }
 
-        const T *operator->() {
-            return &(current_->max_l);
+    const V &at(const K &key) const {
+        auto found = Base::find(key);
+        if (found == Base::end()) {
+            throw std::out_of_range("Map::at");
         }
+        return found->second;
+    }
 
-        iterator &operator++() {
-            move_right();
-            return *this;
-        }
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const K &key, Args &&... args) {
+        auto result = this->insert_to_tree(key, std::piecewise_construct, std::forward_as_tuple(key),
+                                           std::forward_as_tuple(std::forward<Args>(args)...));
+        return std::make_pair(this->make_iterator(result.first), result.second);
+    }
 
-        iterator &operator--() {
-            move_left();
-            return *this;
-        }
+    template<class... Args>
+    iterator try_emplace(typename Base::const_iterator hint, const K &key, Args &&... args) {
+        return this->make_iterator(this->insert_near(this->hint_leaf(hint), key, std::piecewise_construct,
+                                                     std::forward_as_tuple(key),
+                                                     std::forward_as_tuple(std::forward<Args>(args)...)).first);
+    }
 
-        iterator operator++(int) {
-            iterator it(current_);
-            move_right();
-            return it;
-        }
+    // Appends an entry whose key is greater than every key in the map in amortized O(1).
+    template<class... Args>
+    iterator push_back_sorted(const K &key, Args &&... args) {
+        assert(this->empty() || this->back_key() < key);
+        return this->make_iterator(this->append_key(key, std::piecewise_construct, std::forward_as_tuple(key),
+                                                    std::forward_as_tuple(std::forward<Args>(args)...)));
+    }
 
-        iterator operator--(int) {
-            iterator it(current_);
-            move_left();
-            return it;
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(const K &key, M &&value) {
+        auto result = try_emplace(key, std::forward<M>(value));
+        if (!result.second) {
+            result.first->second = std::forward<M>(value);
         }
+        return result;
+    }
 
-        bool operator==(iterator it) const {
-            return (this->is_end == it.is_end && this->current_ == it.current_);
-        }
+    std::pair<iterator, bool> insert(const value_type &element) {
+        return try_emplace(element.first, element.second);
+    }
 
-        bool operator!=(iterator it) const {
-            return !(it == *this);
-        }
+    void erase(const K &key) {
+        this->erase_in_tree(key);
+    }
 
-    private:
-        std::shared_ptr<Node> current_;
+    // Removes the entry at pos and returns an iterator to the one after it.
+    iterator erase(typename Base::const_iterator pos) {
+        typename Base::Trail trail = Base::trail_of(pos);
+        return this->make_iterator(this->erase_at(Base::position(pos), trail));
+    }
 
-        void move_right() {
-            std::shared_ptr<Node> now = current_;
-            while (now->par != nullptr && now == now->par->children.back()) {
-                now = now->par;
-            }
-            if (now->par == nullptr) {
-                is_end = true;
-            } else {
-                if (now == now->par->children[0]) {
-                    current_ = go_left(now->par->children[1]);
-                } else {
-                    current_ = go_left(now->par->children[2]);
-                }
-            }
+    // Removes the entries of [first, last) in O(log^2 n) plus a walk to count them, and returns an
+    // iterator to the entry last pointed to.
+    iterator erase(typename Base::const_iterator first, typename Base::const_iterator last) {
+        if (first == last) {
+            return this->make_iterator(Base::position(last));
         }
+        if (last == this->cend()) {
+            this->erase_range_in_tree(first->first, nullptr);
+            return this->end();
+        }
+        K hi = last->first;
+        this->erase_range_in_tree(first->first, &hi);
+        return this->lower_bound(hi);
+    }
 
-        void move_left() {
-            if (is_end) {
-                is_end = false;
-                return;
-            }
-            std::shared_ptr<Node> now = current_;
-            while (now->par != nullptr && now == now->par->children[0]) {
-                now = now->par;
-            }
-            if (now->par == nullptr) {
-                return;
-            }
+    // Removes the entries with keys in [lo, hi) and returns how many there were.
+    size_t erase_range(const K &lo, const K &hi) {
+        return this->erase_range_in_tree(lo, &hi);
+    }
 
-            if (now == now->par->children[1]) {
-                current_ = go_right(now->par->children[0]);
-            } else {
-                current_ = go_right(now->par->children[1]);
-            }
-        }
-    };
+    // Frees the nodes of ranges erased so far right away instead of on a later erase_range or
+    // on destruction.
+    void reclaim() {
+        this->reclaim_nodes();
+    }
 
-    Set() = default;
+    // Removes every entry satisfying pred, which receives a const value_type &, and returns
+    // how many there were. Rebuilds and threads work as in Set::erase_if.
+    template<class Pred>
+    size_t erase_if(Pred pred, double rebuild_fraction = 0.1, size_t threads = 1) {
+        return this->erase_if_in_tree(pred, rebuild_fraction, threads);
+    }
 
-    template<typename Iterator>
+    void swap(Map &st) noexcept {
+        Base::swap(st);
+    }
 
-    Set(Iterator first, Iterator last) {
-        for (auto it = first; it != last; ++it) {
-            insert_to_tree(*first);
-        }
+    // Moves every key not less than key into the returned map in O(log^2 n), plus moving the
+    // nodes that change maps over to its arena. Iterators into the moved part are invalidated.
+    Map split_off(const K &key) {
+        Map right;
+        this->split_off_into(right, key);
+        return right;
     }
 
-    Set(std::initializer_list<T> initializer_list) {
-        for (const auto &element: initializer_list) {
-            insert_to_tree(element);
-        }
+    // Appends every entry of st, whose keys must all be greater than the keys of this map, in
+    // O(log n), plus moving the nodes of the smaller map into the arena of the larger one.
+    // Iterators into the larger map stay valid unless it was small enough to keep its entries
+    // inline.
+    void join(Map &st) {
+        this->join_tree(st);
     }
+};
 
-    Set(const Set<T> &st) {
-        destroy_vertex(root_);
-        size_ = 0;
-        root_ = nullptr;
-        for (const auto &element: st) {
-            insert(element);
+template<class K, class V, class Pred>
+size_t erase_if(Map<K, V> &map, Pred pred) {
+    return map.erase_if(pred);
+}
+
+// Multiset that stores each distinct key once together with its number of occurrences, so
+// inserting a duplicate only bumps a counter. Iteration visits every distinct key once;
+// count(it) reads the occurrences straight from the iterator's leaf.
+//
+// Iterators and references to keys are invalidated like in Set, by every insert, erase_one,
+// erase_all, clear and assignment, and by moves and swaps of a multiset small enough to keep its
+// keys inline.
+template<class T>
+class Multiset : public TwoThreeTree<T, size_t, KeyAccess<T>> {
+
+private:
+    using Base = TwoThreeTree<T, size_t, KeyAccess<T>>;
+
+    size_t total_ = 0;
+
+public:
+    using typename Base::iterator;
+    using typename Base::const_iterator;
+
+    Multiset() = default;
+
+    template<typename Iterator>
+
+    Multiset(Iterator first, Iterator last) {
+        for (auto it = first; it != last; ++it) {
+            insert(*it);
         }
     }
 
-    Set &operator=(const Set<T> &st) {
-        if (this == &st) {
-            return *this;
-        }
-        destroy_vertex(root_);
-        root_ = nullptr;
-        size_ = 0;
-        for (const auto &element: st) {
+    Multiset(std::initializer_list<T> initializer_list) {
+        for (const auto &element: initializer_list) {
             insert(element);
         }
-        return *this;
     }
 
-    ~Set() = default;
+    Multiset(const Multiset &st) = default;
 
-    size_t size() const {
-        return size_;
+    // total_ travels with the tree, so a moved-from multiset is empty in both counts.
+    Multiset(Multiset &&st) noexcept : Base(std::move(st)), total_(st.total_) {
+        st.total_ = 0;
     }
 
-    bool empty() const {
-        return size_ == 0;
+    Multiset &operator=(const Multiset &st) = default;
+
+    Multiset &operator=(Multiset &&st) noexcept {
+        swap(st);
+        return *this;
     }
 
-    void insert(const T &element) {
-        insert_to_tree(element);
+    size_t size() const {
+        return total_;
     }
 
-    void erase(const T &element) {
-        erase_in_tree(element);
+    size_t distinct_size() const {
+        return Base::size();
     }
 
-    iterator begin() const {
-        std::shared_ptr<Node> now = root_;
-        if (root_ == nullptr) {
-            return end();
-        } else {
-            now = go_left(now);
-            iterator it(now);
-            return it;
+    iterator insert(const T &element, size_t occurrences = 1) {
+        if (occurrences == 0) {
+            return Base::find(element);
+        }
+        auto result = this->insert_to_tree(element, occurrences);
+        if (!result.second) {
+            Base::value(result.first) += occurrences;
         }
+        total_ += occurrences;
+        return this->make_iterator(result.first);
     }
 
-    iterator end() const {
-        std::shared_ptr<Node> now = root_;
-        if (root_ == nullptr) {
-            iterator it(nullptr);
-            it.is_end = true;
-            return it;
-        } else {
-            now = go_right(now);
-            iterator it(now);
-            it.is_end = true;
-            return it;
-        }
+    size_t count(const T &element) const {
+        const_iterator found = Base::find(element);
+        return found == Base::end() ? 0 : count(found);
     }
 
-    iterator find(const T &element) const {
-        std::shared_ptr<Node> found = find_vertex(root_, element);
-        if (found == nullptr) {
-            return end();
-        }
-        if (!is_equal(found->max_l, element)) {
-            return end();
-        }
-        return iterator(found);
+    size_t count(const_iterator it) const {
+        return Base::value(it);
     }
 
-    iterator lower_bound(const T &element) const {
-        std::shared_ptr<Node> found = find_vertex(root_, element);
-        if (found == nullptr) {
-            iterator it = end();
-            return it;
+    // Removes a single occurrence of element and returns the number left.
+    size_t erase_one(const T &element) {
+        typename Base::Position found = this->find_position(element);
+        if (found.leaf == nullptr) {
+            return 0;
         }
-        if (found->max_l < element) {
-            iterator it = end();
-            return it;
+        total_--;
+        if (--Base::value(found) == 0) {
+            this->erase_at(found);
+            return 0;
         }
-        return iterator(found);
+        return Base::value(found);
     }
 
-    static std::shared_ptr<Node> go_right(const std::shared_ptr<Node> &now) {
-        if (now->children.empty()) {
-            return now;
-        } else if (now->children.size() == 2) {
-            return go_right(now->children[1]);
-        } else if (now->children.size() == 3) {
-            return go_right(now->children[2]);
+    // Removes every occurrence of element and returns how many there were.
+    size_t erase_all(const T &element) {
+        typename Base::Position found = this->find_position(element);
+        if (found.leaf == nullptr) {
+            return 0;
         }
+        size_t occurrences = Base::value(found);
+        total_ -= occurrences;
+        this->erase_at(found);
+        return occurrences;
     }
 
-    static std::shared_ptr<Node> go_left(const std::shared_ptr<Node> &now) {
-        if (now->children.empty()) {
-            return now;
-        } else {
-            return go_left(now->children[0]);
-        }
+    void swap(Multiset &st) noexcept {
+        Base::swap(st);
+        std::swap(total_, st.total_);
+    }
+
+    void clear() {
+        Base::clear();
+        total_ = 0;
     }
 };
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Code.h"
+
+// Set with a write-ahead log. Every insert and erase that changes the set appends a one-byte
+// opcode and the key (through Codec) to an in-memory batch; commit writes the batch to the log
+// with a single write and fdatasync, and runs by itself once group_size operations are pending.
+// Operations are durable once the commit covering them returns.
+//
+// Opening loads the last checkpoint and replays the log over it, stopping at a torn tail, which
+// is cut off. Replaying a set operation log twice gives the same set, so a crash between writing
+// a checkpoint and truncating the log is harmless.
+template<class T, class Codec = BinaryCodec<T>>
+class LoggedSet {
+
+private:
+    static constexpr char insert_op_ = '+';
+    static constexpr char erase_op_ = '-';
+
+    // Consecutive inserts commute, so each run is sorted and inserted with the previous key as
+    // the hint.
+    void apply_inserts(std::vector<T> &run) {
+        std::sort(run.begin(), run.end());
+        auto hint = set_.end();
+        for (const T &element: run) {
+            hint = set_.insert(hint, element);
+        }
+        run.clear();
+    }
+
+    void replay() {
+        std::ifstream in(log_path_, std::ios::binary);
+        std::streamoff good = 0;
+        std::vector<T> run;
+        char op;
+        T element;
+        while (in.get(op) && (op == insert_op_ || op == erase_op_) && Codec::read(in, element)) {
+            if (op == insert_op_) {
+                run.push_back(element);
+            } else {
+                apply_inserts(run);
+                set_.erase(element);
+            }
+            good = in.tellg();
+        }
+        apply_inserts(run);
+        if (ftruncate(fd_, good) != 0) {
+            throw std::runtime_error("LoggedSet: cannot truncate " + log_path_);
+        }
+    }
+
+    void append(char op, const T &element) {
+        batch_.put(op);
+        Codec::write(batch_, element);
+        if (++pending_ >= group_size_) {
+            commit();
+        }
+    }
+
+    Set<T> set_;
+    std::string checkpoint_path_, log_path_;
+    int fd_;
+    std::ostringstream batch_;
+    size_t pending_ = 0;
+    size_t group_size_;
+
+public:
+    LoggedSet(const std::string &checkpoint_path, const std::string &log_path, size_t group_size = 256)
+            : checkpoint_path_(checkpoint_path), log_path_(log_path), group_size_(std::max<size_t>(group_size, 1)) {
+        std::ifstream checkpoint(checkpoint_path_, std::ios::binary);
+        if (checkpoint) {
+            set_ = Set<T>::template deserialize<Codec>(checkpoint);
+        }
+        fd_ = open(log_path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("LoggedSet: cannot open " + log_path_);
+        }
+        if (!DurableFile::sync_directory(log_path_)) {
+            ::close(fd_);
+            throw std::runtime_error("LoggedSet: cannot sync the directory of " + log_path_);
+        }
+        try {
+            replay();
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    LoggedSet(const LoggedSet &) = delete;
+
+    LoggedSet &operator=(const LoggedSet &) = delete;
+
+    // Destruction commits the pending operations if close was not called. A failure then cannot
+    // be thrown, so it is reported on stderr; the operations it covered are not durable.
+    ~LoggedSet() {
+        if (fd_ < 0) {
+            return;
+        }
+        try {
+            close();
+        } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << std::endl;
+            ::close(fd_);
+        }
+    }
+
+    const Set<T> &set() const {
+        return set_;
+    }
+
+    size_t size() const {
+        return set_.size();
+    }
+
+    void insert(const T &element) {
+        size_t before = set_.size();
+        set_.insert(element);
+        if (set_.size() != before) {
+            append(insert_op_, element);
+        }
+    }
+
+    void erase(const T &element) {
+        size_t before = set_.size();
+        set_.erase(element);
+        if (set_.size() != before) {
+            append(erase_op_, element);
+        }
+    }
+
+    // Makes every operation so far durable with one write and one fdatasync.
+    void commit() {
+        if (pending_ == 0) {
+            return;
+        }
+        std::string records = batch_.str();
+        for (size_t done = 0; done < records.size();) {
+            ssize_t written = write(fd_, records.data() + done, records.size() - done);
+            if (written < 0) {
+                throw std::runtime_error("LoggedSet: cannot write " + log_path_);
+            }
+            done += written;
+        }
+        if (fdatasync(fd_) != 0) {
+            throw std::runtime_error("LoggedSet: cannot sync " + log_path_);
+        }
+        batch_.str(std::string());
+        pending_ = 0;
+    }
+
+    // Commits the pending operations and closes the log, throwing if the commit fails. The set is
+    // unusable afterwards.
+    void close() {
+        commit();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Writes a checkpoint of the current set and empties the log it supersedes. The log is only
+    // cut once the checkpoint file and the rename that put it in place are on disk, so a crash at
+    // any point leaves either the old checkpoint with the full log or the new one.
+    void checkpoint() {
+        commit();
+        set_.template checkpoint<Codec>(checkpoint_path_).get();
+        if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+            throw std::runtime_error("LoggedSet: cannot truncate " + log_path_);
+        }
+    }
+};
+
+template<class T, class Codec>
+constexpr char LoggedSet<T, Codec>::insert_op_;
+
+template<class T, class Codec>
+constexpr char LoggedSet<T, Codec>::erase_op_;
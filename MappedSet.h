@@ -0,0 +1,302 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Code.h"
+
+// Read-only Set served straight out of a file image, so that processes mapping the same file
+// share one physical copy through the page cache and open it without deserializing.
+//
+// The image is position independent: a header, the keys packed in ascending order, and then the
+// internal nodes of a 2-3 tree built bottom-up over them. Nodes refer to their children by index
+// and route with max_l / max_mid exactly like the heap tree. Since the keys are packed, an
+// iterator is a plain pointer into the mapping.
+template<class T>
+class MappedSet {
+
+    static_assert(std::is_trivially_copyable<T>::value, "MappedSet needs a trivially copyable type");
+
+private:
+    // Children of a node are consecutive on the level below: keys for the lowest level, nodes
+    // otherwise.
+    struct Node {
+        uint64_t first;
+        uint64_t count;
+        T max_l, max_mid;
+    };
+
+    struct Level {
+        uint64_t first, count;
+    };
+
+    struct Header {
+        char magic[8];
+        uint64_t key_size, node_size;
+        uint64_t size, height, root;
+        uint64_t keys_offset, nodes_offset, node_count;
+    };
+
+    static constexpr char magic_[8] = {'2', '3', 'T', 'R', 'E', 'E', 'M', '1'};
+
+    // Bytes of keys freeze gathers before handing them to the file.
+    static constexpr size_t flush_size_ = 1 << 20;
+
+    static uint64_t align(uint64_t offset, uint64_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    static void pad(std::string &out, uint64_t from, uint64_t to) {
+        out.append(to - from, '\0');
+    }
+
+    // Groups m consecutive items into nodes of three, ending with one or two nodes of two, and
+    // collects the maxima of the new nodes for the next level.
+    template<class Iterator>
+    static void build_level(Iterator it, uint64_t m, uint64_t base, std::vector<Node> &nodes, std::vector<T> &maxima) {
+        uint64_t groups = (m + 2) / 3;
+        uint64_t pairs = 3 * groups - m;
+        std::vector<T> next;
+        next.reserve(groups);
+        uint64_t first = base;
+        for (uint64_t j = 0; j < groups; ++j) {
+            Node node;
+            std::memset(&node, 0, sizeof(node));
+            node.first = first;
+            node.count = j + pairs >= groups ? 2 : 3;
+            node.max_l = *it++;
+            node.max_mid = *it++;
+            T max = node.max_mid;
+            if (node.count == 3) {
+                max = *it++;
+            }
+            nodes.push_back(node);
+            next.push_back(max);
+            first += node.count;
+        }
+        maxima.swap(next);
+    }
+
+    // Descends from the root, checking each node it reads against the bounds of the level below,
+    // so a damaged image makes the lookup throw instead of reading outside the mapping. Only the
+    // O(log n) nodes on the path are touched, which keeps opening a large image free.
+    uint64_t lower_index(const T &key) const {
+        if (size() == 0) {
+            return 0;
+        }
+        uint64_t index = header_->root;
+        for (uint64_t level = header_->height; level > 0; --level) {
+            const Node &node = nodes_[index];
+            const Level &below = levels_[level - 1];
+            if ((node.count != 2 && node.count != 3) || node.first < below.first ||
+                node.first - below.first > below.count - node.count) {
+                throw std::runtime_error("MappedSet: corrupt node " + std::to_string(index));
+            }
+            uint64_t child = 0;
+            if (node.count == 3 && node.max_mid < key) {
+                child = 2;
+            } else if (node.max_l < key) {
+                child = 1;
+            }
+            index = node.first + child;
+        }
+        return keys_[index] < key ? index + 1 : index;
+    }
+
+    // Works out from header_->size alone where freeze put each level: the keys, then the nodes
+    // level by level from the bottom. Returns false unless that matches the height, node count
+    // and root the header claims.
+    bool plan_levels() {
+        levels_.assign(1, Level{0, header_->size});
+        uint64_t first = 0;
+        while (levels_.back().count > 1) {
+            uint64_t groups = (levels_.back().count + 2) / 3;
+            levels_.push_back(Level{first, groups});
+            first += groups;
+        }
+        return levels_.size() - 1 == header_->height && first == header_->node_count &&
+               header_->root == (first == 0 ? 0 : first - 1);
+    }
+
+    void unmap() {
+        if (image_ != nullptr) {
+            munmap(image_, length_);
+        }
+        image_ = nullptr;
+        length_ = 0;
+    }
+
+    void *image_ = nullptr;
+    size_t length_ = 0;
+    const Header *header_ = nullptr;
+    const T *keys_ = nullptr;
+    const Node *nodes_ = nullptr;
+    // The span of each level, keys first; entry i holds the children of the nodes on level i + 1.
+    std::vector<Level> levels_;
+
+public:
+    using const_iterator = const T *;
+    using iterator = const_iterator;
+
+    // Writes the image of set to path.
+    static void freeze(const Set<T> &set, const std::string &path) {
+        uint64_t size = set.size();
+        std::vector<Node> nodes;
+        std::vector<T> maxima;
+        uint64_t height = 0, root = 0;
+        if (size > 1) {
+            build_level(set.begin(), size, 0, nodes, maxima);
+            height = 1;
+            uint64_t base = 0;
+            while (maxima.size() > 1) {
+                uint64_t level_base = nodes.size();
+                build_level(maxima.begin(), maxima.size(), base, nodes, maxima);
+                base = level_base;
+                height++;
+            }
+            root = nodes.size() - 1;
+        }
+
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, magic_, sizeof(magic_));
+        header.key_size = sizeof(T);
+        header.node_size = sizeof(Node);
+        header.size = size;
+        header.height = height;
+        header.root = root;
+        header.keys_offset = align(sizeof(Header), alignof(T));
+        header.nodes_offset = align(header.keys_offset + size * sizeof(T), alignof(Node));
+        header.node_count = nodes.size();
+
+        // The image is written beside path and renamed over it, so processes that have the old
+        // one mapped keep reading it intact instead of faulting on a file shrinking under them.
+        DurableFile file(path, "MappedSet::freeze");
+        std::string buffer(reinterpret_cast<const char *>(&header), sizeof(header));
+        pad(buffer, sizeof(header), header.keys_offset);
+        for (const T &key: set) {
+            buffer.append(reinterpret_cast<const char *>(&key), sizeof(T));
+            if (buffer.size() >= flush_size_) {
+                file.write(buffer);
+                buffer.clear();
+            }
+        }
+        pad(buffer, header.keys_offset + size * sizeof(T), header.nodes_offset);
+        file.write(buffer);
+        file.write(reinterpret_cast<const char *>(nodes.data()), nodes.size() * sizeof(Node));
+        file.commit();
+    }
+
+    explicit MappedSet(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("MappedSet: cannot open " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+            close(fd);
+            throw std::runtime_error("MappedSet: bad image " + path);
+        }
+        length_ = info.st_size;
+        image_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (image_ == MAP_FAILED) {
+            image_ = nullptr;
+            throw std::runtime_error("MappedSet: cannot map " + path);
+        }
+        const char *base = static_cast<const char *>(image_);
+        header_ = reinterpret_cast<const Header *>(base);
+        if (std::memcmp(header_->magic, magic_, sizeof(magic_)) != 0 || header_->key_size != sizeof(T) ||
+            header_->node_size != sizeof(Node) || header_->keys_offset % alignof(T) != 0 ||
+            header_->nodes_offset % alignof(Node) != 0 || header_->keys_offset > length_ ||
+            header_->nodes_offset > length_ || header_->size > length_ / sizeof(T) ||
+            header_->node_count > length_ / sizeof(Node) ||
+            header_->keys_offset + header_->size * sizeof(T) > length_ ||
+            header_->nodes_offset + header_->node_count * sizeof(Node) > length_) {
+            unmap();
+            throw std::runtime_error("MappedSet: bad image " + path);
+        }
+        keys_ = reinterpret_cast<const T *>(base + header_->keys_offset);
+        nodes_ = reinterpret_cast<const Node *>(base + header_->nodes_offset);
+        if (!plan_levels()) {
+            unmap();
+            throw std::runtime_error("MappedSet: bad image " + path);
+        }
+    }
+
+    MappedSet(const MappedSet &) = delete;
+
+    MappedSet &operator=(const MappedSet &) = delete;
+
+    MappedSet(MappedSet &&st) noexcept
+            : image_(st.image_), length_(st.length_), header_(st.header_), keys_(st.keys_), nodes_(st.nodes_),
+              levels_(std::move(st.levels_)) {
+        st.image_ = nullptr;
+        st.length_ = 0;
+        st.header_ = nullptr;
+        st.keys_ = nullptr;
+        st.nodes_ = nullptr;
+    }
+
+    MappedSet &operator=(MappedSet &&st) noexcept {
+        std::swap(image_, st.image_);
+        std::swap(length_, st.length_);
+        std::swap(header_, st.header_);
+        std::swap(keys_, st.keys_);
+        std::swap(nodes_, st.nodes_);
+        levels_.swap(st.levels_);
+        return *this;
+    }
+
+    ~MappedSet() {
+        unmap();
+    }
+
+    // A moved-from MappedSet is empty.
+    size_t size() const {
+        return header_ == nullptr ? 0 : header_->size;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const_iterator begin() const {
+        return keys_;
+    }
+
+    const_iterator end() const {
+        return keys_ + size();
+    }
+
+    const_iterator find(const T &element) const {
+        const_iterator found = lower_bound(element);
+        if (found == end() || element < *found) {
+            return end();
+        }
+        return found;
+    }
+
+    const_iterator lower_bound(const T &element) const {
+        return keys_ + lower_index(element);
+    }
+
+    const_iterator upper_bound(const T &element) const {
+        const_iterator found = lower_bound(element);
+        return found != end() && !(element < *found) ? found + 1 : found;
+    }
+};
+
+template<class T>
+constexpr char MappedSet<T>::magic_[8];
@@ -0,0 +1,674 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Fixed number of in-memory frames caching pages of one file, replaced with the CLOCK policy.
+// Pinned pages are never evicted; dirty pages are written back on eviction and on flush.
+class BufferPool {
+
+private:
+    struct Frame {
+        std::unique_ptr<char[]> data;
+        uint64_t page = 0;
+        size_t pins = 0;
+        bool used = false, dirty = false, referenced = false;
+    };
+
+    void write_back(Frame &frame) {
+        if (!frame.dirty) {
+            return;
+        }
+        if (pwrite(fd_, frame.data.get(), page_size_, frame.page * page_size_) != static_cast<ssize_t>(page_size_)) {
+            throw std::runtime_error("BufferPool: write failed");
+        }
+        frame.dirty = false;
+    }
+
+    size_t victim() {
+        for (size_t step = 0; step <= 2 * frames_.size(); ++step) {
+            size_t index = hand_;
+            hand_ = (hand_ + 1) % frames_.size();
+            Frame &frame = frames_[index];
+            if (!frame.used) {
+                return index;
+            }
+            if (frame.pins > 0) {
+                continue;
+            }
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+            return index;
+        }
+        throw std::runtime_error("BufferPool: every frame is pinned");
+    }
+
+    int fd_;
+    size_t page_size_;
+    std::vector<Frame> frames_;
+    std::unordered_map<uint64_t, size_t> table_;
+    size_t hand_ = 0;
+
+public:
+    BufferPool(int fd, size_t page_size, size_t capacity)
+            : fd_(fd), page_size_(page_size), frames_(std::max<size_t>(capacity, 1)) {
+        for (auto &frame: frames_) {
+            frame.data.reset(new char[page_size_]);
+        }
+    }
+
+    BufferPool(const BufferPool &) = delete;
+
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    // Pins page and returns its bytes. Pages past the end of the file read as zeros.
+    char *pin(uint64_t page) {
+        auto found = table_.find(page);
+        if (found != table_.end()) {
+            Frame &frame = frames_[found->second];
+            frame.pins++;
+            frame.referenced = true;
+            return frame.data.get();
+        }
+        size_t index = victim();
+        Frame &frame = frames_[index];
+        if (frame.used) {
+            write_back(frame);
+            table_.erase(frame.page);
+            frame.used = false;
+        }
+        ssize_t got = pread(fd_, frame.data.get(), page_size_, page * page_size_);
+        if (got < 0) {
+            throw std::runtime_error("BufferPool: read failed");
+        }
+        std::memset(frame.data.get() + got, 0, page_size_ - got);
+        frame.page = page;
+        frame.pins = 1;
+        frame.used = frame.referenced = true;
+        table_[page] = index;
+        return frame.data.get();
+    }
+
+    void unpin(uint64_t page, bool dirty) {
+        Frame &frame = frames_[table_.at(page)];
+        frame.pins--;
+        frame.dirty = frame.dirty || dirty;
+    }
+
+    // Writes every dirty page back and syncs the file.
+    void flush() {
+        for (auto &frame: frames_) {
+            if (frame.used) {
+                write_back(frame);
+            }
+        }
+        if (fdatasync(fd_) != 0) {
+            throw std::runtime_error("BufferPool: sync failed");
+        }
+    }
+};
+
+// External-memory Set: a B+-tree whose nodes are PageSize-byte pages of a file, accessed through
+// a BufferPool of bounded capacity, so memory use does not grow with the number of keys. Leaves
+// hold the keys in order and are chained both ways for iteration; internal pages hold
+// separators, child i + 1 taking the keys not less than separator i.
+//
+// Erasure is lazy: pages are only reclaimed once they become empty, and go to a free list that
+// later splits reuse. Page 0 keeps the metadata, which is written back by flush and close;
+// reopening the file restores the set. Iterators cache their key and are invalidated by any
+// modification.
+//
+// The metadata carries a clean flag. The first modification after opening or flushing clears
+// it on disk before any other page can be written back, and flush sets it again once every page
+// is synced. A file whose flag is clear was left mid-update by a crash and is refused on open.
+template<class T, size_t PageSize = 4096>
+class PagedSet {
+
+    static_assert(std::is_trivially_copyable<T>::value, "PagedSet needs a trivially copyable type");
+
+private:
+    struct PageHeader {
+        uint32_t leaf;
+        uint32_t count;
+        uint64_t next, prev;
+    };
+
+    struct Meta {
+        char magic[8];
+        uint64_t page_size, key_size;
+        uint64_t root, height, size, page_count, free_list, first_leaf, last_leaf;
+        uint64_t clean;
+    };
+
+    static_assert(sizeof(Meta) <= PageSize, "PageSize is too small");
+
+    static constexpr size_t align(size_t offset, size_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    static constexpr size_t leaf_keys_offset() {
+        return align(sizeof(PageHeader), alignof(T));
+    }
+
+    static constexpr size_t leaf_capacity() {
+        return (PageSize - leaf_keys_offset()) / sizeof(T);
+    }
+
+    // Internal pages store capacity + 1 child ids right after the header and the separators
+    // after them.
+    static constexpr size_t internal_keys_offset(size_t capacity) {
+        return align(sizeof(PageHeader) + sizeof(uint64_t) * (capacity + 1), alignof(T));
+    }
+
+    static constexpr size_t internal_capacity() {
+        size_t capacity = 0;
+        while (internal_keys_offset(capacity + 1) + (capacity + 1) * sizeof(T) <= PageSize) {
+            capacity++;
+        }
+        return capacity;
+    }
+
+    static_assert(leaf_capacity() >= 2 && internal_capacity() >= 2, "PageSize is too small for T");
+
+    // Pin on one page for as long as the handle lives.
+    class Page {
+    public:
+        Page(BufferPool &pool, uint64_t id) : pool_(&pool), id_(id), data_(pool.pin(id)) {}
+
+        Page(const Page &) = delete;
+
+        Page &operator=(const Page &) = delete;
+
+        Page(Page &&page) noexcept: pool_(page.pool_), id_(page.id_), data_(page.data_), dirty_(page.dirty_) {
+            page.pool_ = nullptr;
+        }
+
+        ~Page() {
+            if (pool_ != nullptr) {
+                pool_->unpin(id_, dirty_);
+            }
+        }
+
+        uint64_t id() const {
+            return id_;
+        }
+
+        void dirty() {
+            dirty_ = true;
+        }
+
+        char *data() const {
+            return data_;
+        }
+
+        PageHeader &header() const {
+            return *reinterpret_cast<PageHeader *>(data_);
+        }
+
+        T *keys() const {
+            return reinterpret_cast<T *>(data_ + (header().leaf ? leaf_keys_offset()
+                                                                : internal_keys_offset(internal_capacity())));
+        }
+
+        uint64_t *children() const {
+            return reinterpret_cast<uint64_t *>(data_ + sizeof(PageHeader));
+        }
+
+    private:
+        BufferPool *pool_;
+        uint64_t id_;
+        char *data_;
+        bool dirty_ = false;
+    };
+
+    using Path = std::vector<std::pair<uint64_t, size_t>>;
+
+    static constexpr char magic_[8] = {'2', '3', 'T', 'R', 'E', 'E', 'P', '2'};
+
+    static int open_file(const std::string &path) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("PagedSet: cannot open " + path);
+        }
+        return fd;
+    }
+
+    // Descends to the leaf that holds or would hold key, recording the internal pages visited
+    // and the child taken in each.
+    uint64_t descend(const T &key, Path *path) const {
+        uint64_t id = meta_.root;
+        for (uint64_t level = meta_.height; level > 0; --level) {
+            Page page(pool_, id);
+            T *keys = page.keys();
+            size_t index = std::upper_bound(keys, keys + page.header().count, key) - keys;
+            if (path != nullptr) {
+                path->emplace_back(id, index);
+            }
+            id = page.children()[index];
+        }
+        return id;
+    }
+
+    Page allocate(bool leaf) {
+        uint64_t id = meta_.free_list;
+        if (id != 0) {
+            Page page(pool_, id);
+            meta_.free_list = page.header().next;
+        } else {
+            id = meta_.page_count++;
+        }
+        Page page(pool_, id);
+        page.dirty();
+        page.header() = PageHeader{leaf, 0, 0, 0};
+        return page;
+    }
+
+    void release(uint64_t id) {
+        Page page(pool_, id);
+        page.dirty();
+        page.header() = PageHeader{0, 0, meta_.free_list, 0};
+        meta_.free_list = id;
+    }
+
+    // Inserts separator and the page right after child index of an internal page. When the page
+    // overflows it is split, the right half is returned and separator receives the key that
+    // moves up; otherwise 0 is returned.
+    uint64_t insert_child(Page &page, size_t index, T &separator, uint64_t right) {
+        PageHeader &header = page.header();
+        T *keys = page.keys();
+        uint64_t *children = page.children();
+        page.dirty();
+        if (header.count < internal_capacity()) {
+            std::move_backward(keys + index, keys + header.count, keys + header.count + 1);
+            std::move_backward(children + index + 1, children + header.count + 1, children + header.count + 2);
+            keys[index] = separator;
+            children[index + 1] = right;
+            header.count++;
+            return 0;
+        }
+        std::vector<T> all_keys(keys, keys + header.count);
+        std::vector<uint64_t> all_children(children, children + header.count + 1);
+        all_keys.insert(all_keys.begin() + index, separator);
+        all_children.insert(all_children.begin() + index + 1, right);
+        size_t middle = all_keys.size() / 2;
+
+        Page sibling = allocate(false);
+        PageHeader &sibling_header = sibling.header();
+        sibling_header.count = all_keys.size() - middle - 1;
+        std::copy(all_keys.begin() + middle + 1, all_keys.end(), sibling.keys());
+        std::copy(all_children.begin() + middle + 1, all_children.end(), sibling.children());
+        header.count = middle;
+        std::copy(all_keys.begin(), all_keys.begin() + middle, keys);
+        std::copy(all_children.begin(), all_children.begin() + middle + 1, children);
+        separator = all_keys[middle];
+        return sibling.id();
+    }
+
+    // Drops child index of an internal page together with the separator next to it.
+    static void remove_child(Page &page, size_t index) {
+        PageHeader &header = page.header();
+        T *keys = page.keys();
+        uint64_t *children = page.children();
+        page.dirty();
+        std::move(children + index + 1, children + header.count + 1, children + index);
+        size_t key = index > 0 ? index - 1 : 0;
+        std::move(keys + key + 1, keys + header.count, keys + key);
+        header.count--;
+    }
+
+    void write_meta() {
+        Page page(pool_, 0);
+        page.dirty();
+        std::memcpy(page.data(), &meta_, sizeof(Meta));
+    }
+
+    // Called before the first change to any page: persists a cleared clean flag, so a crash
+    // from here until the next flush is detected on open.
+    void begin_update() {
+        if (meta_.clean == 0) {
+            return;
+        }
+        meta_.clean = 0;
+        write_meta();
+        pool_.flush();
+    }
+
+    void unlink_leaf(const PageHeader &header) {
+        if (header.prev != 0) {
+            Page prev(pool_, header.prev);
+            prev.dirty();
+            prev.header().next = header.next;
+        } else {
+            meta_.first_leaf = header.next;
+        }
+        if (header.next != 0) {
+            Page next(pool_, header.next);
+            next.dirty();
+            next.header().prev = header.prev;
+        } else {
+            meta_.last_leaf = header.prev;
+        }
+    }
+
+    int fd_;
+    mutable BufferPool pool_;
+    Meta meta_;
+
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using reference = const T &;
+        using pointer = const T *;
+
+        const_iterator() = default;
+
+        reference operator*() const {
+            return value_;
+        }
+
+        pointer operator->() const {
+            return &value_;
+        }
+
+        const_iterator &operator++() {
+            {
+                Page page(owner_->pool_, page_);
+                if (index_ + 1 < page.header().count) {
+                    value_ = page.keys()[++index_];
+                    return *this;
+                }
+                page_ = page.header().next;
+                index_ = 0;
+            }
+            load();
+            return *this;
+        }
+
+        const_iterator &operator--() {
+            if (page_ == 0) {
+                page_ = owner_->meta_.last_leaf;
+                index_ = Page(owner_->pool_, page_).header().count;
+            } else if (index_ == 0) {
+                page_ = Page(owner_->pool_, page_).header().prev;
+                index_ = Page(owner_->pool_, page_).header().count;
+            }
+            index_--;
+            load();
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        const_iterator operator--(int) {
+            const_iterator it = *this;
+            --*this;
+            return it;
+        }
+
+        bool operator==(const const_iterator &it) const {
+            return page_ == it.page_ && index_ == it.index_;
+        }
+
+        bool operator!=(const const_iterator &it) const {
+            return !(it == *this);
+        }
+
+    private:
+        friend class PagedSet;
+
+        const_iterator(const PagedSet *owner, uint64_t page, size_t index) : owner_(owner), page_(page), index_(index) {
+            load();
+        }
+
+        void load() {
+            if (page_ != 0) {
+                value_ = Page(owner_->pool_, page_).keys()[index_];
+            }
+        }
+
+        const PagedSet *owner_ = nullptr;
+        uint64_t page_ = 0;
+        size_t index_ = 0;
+        T value_{};
+    };
+
+    using iterator = const_iterator;
+
+    // Opens the set stored at path, creating an empty one if the file is empty or missing.
+    // pool_pages bounds the number of pages held in memory.
+    explicit PagedSet(const std::string &path, size_t pool_pages = 1024)
+            : fd_(open_file(path)), pool_(fd_, PageSize, std::max<size_t>(pool_pages, 8)) {
+        struct stat info;
+        if (fstat(fd_, &info) == 0 && info.st_size >= static_cast<off_t>(PageSize)) {
+            std::memcpy(&meta_, Page(pool_, 0).data(), sizeof(Meta));
+            if (std::memcmp(meta_.magic, magic_, sizeof(magic_)) != 0 || meta_.page_size != PageSize ||
+                meta_.key_size != sizeof(T)) {
+                ::close(fd_);
+                throw std::runtime_error("PagedSet: bad file " + path);
+            }
+            if (meta_.clean == 0) {
+                ::close(fd_);
+                throw std::runtime_error("PagedSet: " + path + " was not closed cleanly");
+            }
+            return;
+        }
+        std::memset(&meta_, 0, sizeof(meta_));
+        std::memcpy(meta_.magic, magic_, sizeof(magic_));
+        meta_.page_size = PageSize;
+        meta_.key_size = sizeof(T);
+        meta_.page_count = 1;
+        meta_.root = meta_.first_leaf = meta_.last_leaf = allocate(true).id();
+        try {
+            flush();
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    PagedSet(const PagedSet &) = delete;
+
+    PagedSet &operator=(const PagedSet &) = delete;
+
+    // Destruction closes the file if close was not called. A failure then cannot be thrown, so
+    // it is reported on stderr, and the file stays marked unclean.
+    ~PagedSet() {
+        if (fd_ < 0) {
+            return;
+        }
+        try {
+            close();
+        } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << std::endl;
+            ::close(fd_);
+        }
+    }
+
+    // Writes every dirty page back and then marks the file clean. The pages are synced before the
+    // flag is written, so the flag is never on disk ahead of the data it vouches for.
+    void flush() {
+        write_meta();
+        pool_.flush();
+        meta_.clean = 1;
+        write_meta();
+        pool_.flush();
+    }
+
+    // Flushes and closes the file, throwing if the flush fails. The set is unusable afterwards.
+    void close() {
+        flush();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    size_t size() const {
+        return meta_.size;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void insert(const T &element) {
+        Path path;
+        uint64_t id = descend(element, &path);
+        T separator;
+        uint64_t right;
+        {
+            Page page(pool_, id);
+            PageHeader &header = page.header();
+            T *keys = page.keys();
+            size_t index = std::lower_bound(keys, keys + header.count, element) - keys;
+            if (index < header.count && !(element < keys[index])) {
+                return;
+            }
+            begin_update();
+            meta_.size++;
+            page.dirty();
+            if (header.count < leaf_capacity()) {
+                std::move_backward(keys + index, keys + header.count, keys + header.count + 1);
+                keys[index] = element;
+                header.count++;
+                return;
+            }
+            std::vector<T> all_keys(keys, keys + header.count);
+            all_keys.insert(all_keys.begin() + index, element);
+            size_t middle = all_keys.size() / 2;
+
+            Page sibling = allocate(true);
+            PageHeader &sibling_header = sibling.header();
+            sibling_header.count = all_keys.size() - middle;
+            std::copy(all_keys.begin() + middle, all_keys.end(), sibling.keys());
+            header.count = middle;
+            std::copy(all_keys.begin(), all_keys.begin() + middle, keys);
+
+            sibling_header.prev = id;
+            sibling_header.next = header.next;
+            if (header.next != 0) {
+                Page next(pool_, header.next);
+                next.dirty();
+                next.header().prev = sibling.id();
+            } else {
+                meta_.last_leaf = sibling.id();
+            }
+            header.next = sibling.id();
+            separator = all_keys[middle];
+            right = sibling.id();
+        }
+        while (right != 0 && !path.empty()) {
+            Page page(pool_, path.back().first);
+            right = insert_child(page, path.back().second, separator, right);
+            path.pop_back();
+        }
+        if (right != 0) {
+            Page root = allocate(false);
+            root.header().count = 1;
+            root.keys()[0] = separator;
+            root.children()[0] = meta_.root;
+            root.children()[1] = right;
+            meta_.root = root.id();
+            meta_.height++;
+        }
+    }
+
+    void erase(const T &element) {
+        Path path;
+        uint64_t id = descend(element, &path);
+        {
+            Page page(pool_, id);
+            PageHeader &header = page.header();
+            T *keys = page.keys();
+            size_t index = std::lower_bound(keys, keys + header.count, element) - keys;
+            if (index == header.count || element < keys[index]) {
+                return;
+            }
+            begin_update();
+            meta_.size--;
+            page.dirty();
+            std::move(keys + index + 1, keys + header.count, keys + index);
+            header.count--;
+            if (header.count > 0 || path.empty()) {
+                return;
+            }
+            unlink_leaf(header);
+        }
+        release(id);
+        while (!path.empty()) {
+            Page page(pool_, path.back().first);
+            size_t index = path.back().second;
+            path.pop_back();
+            if (page.header().count > 0) {
+                remove_child(page, index);
+                break;
+            }
+            release(page.id());
+        }
+        while (meta_.height > 0) {
+            uint64_t child;
+            {
+                Page root(pool_, meta_.root);
+                if (root.header().count > 0) {
+                    break;
+                }
+                child = root.children()[0];
+            }
+            release(meta_.root);
+            meta_.root = child;
+            meta_.height--;
+        }
+    }
+
+    const_iterator begin() const {
+        return empty() ? end() : const_iterator(this, meta_.first_leaf, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, 0, 0);
+    }
+
+    const_iterator find(const T &element) const {
+        const_iterator found = lower_bound(element);
+        if (found == end() || element < *found) {
+            return end();
+        }
+        return found;
+    }
+
+    const_iterator lower_bound(const T &element) const {
+        uint64_t id = descend(element, nullptr);
+        Page page(pool_, id);
+        T *keys = page.keys();
+        size_t index = std::lower_bound(keys, keys + page.header().count, element) - keys;
+        if (index < page.header().count) {
+            return const_iterator(this, id, index);
+        }
+        return const_iterator(this, page.header().next, 0);
+    }
+};
+
+template<class T, size_t PageSize>
+constexpr char PagedSet<T, PageSize>::magic_[8];
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Code.h"
+
+// Splits the key space into range partitions, each backed by its own Set and mutex, so that
+// writers touching different ranges never serialize on one tree. Shards are activated and
+// rebalanced online with Set::split_off / Set::join when they grow uneven.
+//
+// insert, erase, contains and size are safe to call concurrently. Iteration and lower_bound
+// walk the shards directly and need the set to be quiescent.
+//
+// A writer touches nothing shared but the pivot pointer, which it only loads: the pivots are
+// published as an immutable array behind a plain atomic pointer, and every version stays alive
+// until the set is destroyed, so readers neither lock nor count references. Each shard counts
+// its own keys and size() adds the counters up, so there is no global counter to contend on.
+template<class T>
+class ShardedSet {
+
+private:
+    struct Shard {
+        Set<T> set;
+        std::mutex mutex;
+        std::atomic<size_t> size{0};
+        bool has_lower = false, has_upper = false;
+        T lower, upper;
+
+        bool owns(const T &key) const {
+            return (!has_lower || !(key < lower)) && (!has_upper || key < upper);
+        }
+    };
+
+    using Pivots = std::vector<T>;
+
+    size_t route(const T &key) const {
+        const Pivots *pivots = pivots_.load(std::memory_order_acquire);
+        return std::upper_bound(pivots->begin(), pivots->end(), key) - pivots->begin();
+    }
+
+    size_t active() const {
+        return pivots_.load(std::memory_order_acquire)->size() + 1;
+    }
+
+    // Locks the shard that currently owns key. The pivot snapshot may be stale by the time the
+    // mutex is held, so ownership is re-checked against the bounds the shard itself keeps.
+    size_t lock_owner(const T &key, std::unique_lock<std::mutex> &guard) const {
+        while (true) {
+            size_t index = route(key);
+            guard = std::unique_lock<std::mutex>(shards_[index]->mutex);
+            if (shards_[index]->owns(key)) {
+                return index;
+            }
+            guard.unlock();
+        }
+    }
+
+    // Called under rebalance_mutex_, which also guards versions_. The previous array is kept,
+    // since writers may still be reading it.
+    void publish_pivot(size_t index, const T &pivot) {
+        std::unique_ptr<Pivots> pivots(new Pivots(*pivots_.load(std::memory_order_relaxed)));
+        if (index < pivots->size()) {
+            (*pivots)[index] = pivot;
+        } else {
+            pivots->push_back(pivot);
+        }
+        pivots_.store(pivots.get(), std::memory_order_release);
+        versions_.emplace_back(std::move(pivots));
+    }
+
+    // Moves the keys of shard index from key pivot onwards into shard index + 1.
+    void move_right(size_t index, const T &pivot) {
+        Shard &from = *shards_[index];
+        Shard &to = *shards_[index + 1];
+        Set<T> moved = from.set.split_off(pivot);
+        moved.join(to.set);
+        to.set.swap(moved);
+        from.size = from.set.size();
+        to.size = to.set.size();
+        from.has_upper = to.has_lower = true;
+        from.upper = to.lower = pivot;
+        publish_pivot(index, pivot);
+    }
+
+    // Moves the keys of shard index below pivot into shard index - 1.
+    void move_left(size_t index, const T &pivot) {
+        Shard &from = *shards_[index];
+        Shard &to = *shards_[index - 1];
+        Set<T> kept = from.set.split_off(pivot);
+        to.set.join(from.set);
+        from.set.swap(kept);
+        from.size = from.set.size();
+        to.size = to.set.size();
+        to.upper = from.lower = pivot;
+        publish_pivot(index - 1, pivot);
+    }
+
+    void rebalance(size_t index) {
+        std::unique_lock<std::mutex> rebalancing(rebalance_mutex_, std::try_to_lock);
+        if (!rebalancing.owns_lock()) {
+            return;
+        }
+        size_t count = active();
+        if (index + 1 == count && count < shards_.size()) {
+            std::lock(shards_[index]->mutex, shards_[index + 1]->mutex);
+            std::lock_guard<std::mutex> from(shards_[index]->mutex, std::adopt_lock);
+            std::lock_guard<std::mutex> to(shards_[index + 1]->mutex, std::adopt_lock);
+            const Set<T> &set = shards_[index]->set;
+            if (set.size() > threshold_) {
+                move_right(index, set.approximate_quantile(0.5));
+            }
+            return;
+        }
+
+        size_t neighbour = index + 1;
+        if (index + 1 == count || (index > 0 && shards_[index - 1]->size < shards_[index + 1]->size)) {
+            neighbour = index - 1;
+        }
+        if (neighbour >= count) {
+            return;
+        }
+        std::lock(shards_[index]->mutex, shards_[neighbour]->mutex);
+        std::lock_guard<std::mutex> from(shards_[index]->mutex, std::adopt_lock);
+        std::lock_guard<std::mutex> to(shards_[neighbour]->mutex, std::adopt_lock);
+        const Set<T> &set = shards_[index]->set;
+        size_t other = shards_[neighbour]->set.size();
+        if (set.size() <= other + threshold_) {
+            return;
+        }
+        double share = static_cast<double>((set.size() - other) / 2) / set.size();
+        if (neighbour > index) {
+            move_right(index, set.approximate_quantile(1 - share));
+        } else {
+            move_left(index, set.approximate_quantile(share));
+        }
+    }
+
+    // Comparing a shard with the mean reads the counters of every shard, which other writers
+    // keep changing, so a shard past the threshold only does it once per check_interval_ keys.
+    bool overloaded(size_t index, size_t shard_size) const {
+        if (shard_size <= threshold_) {
+            return false;
+        }
+        size_t count = active();
+        if (index + 1 == count && count < shards_.size()) {
+            return true;
+        }
+        return shard_size % check_interval_ == 0 && shard_size > 2 * size() / count;
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<const Pivots *> pivots_;
+    std::vector<std::unique_ptr<const Pivots>> versions_;
+    std::mutex rebalance_mutex_;
+    size_t threshold_, check_interval_;
+
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using reference = const T &;
+        using pointer = const T *;
+
+        iterator() = default;
+
+        reference operator*() const {
+            return *current_;
+        }
+
+        pointer operator->() const {
+            return &(*current_);
+        }
+
+        iterator &operator++() {
+            ++current_;
+            skip_empty();
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==(const iterator &it) const {
+            return shard_ == it.shard_ && (shard_ == nullptr || current_ == it.current_);
+        }
+
+        bool operator!=(const iterator &it) const {
+            return !(it == *this);
+        }
+
+    private:
+        friend class ShardedSet;
+
+        iterator(const ShardedSet *owner, size_t index, typename Set<T>::const_iterator current)
+                : owner_(owner), index_(index), current_(current) {
+            shard_ = owner_->shards_[index_].get();
+            skip_empty();
+        }
+
+        void skip_empty() {
+            while (current_ == shard_->set.end()) {
+                if (++index_ == owner_->shards_.size()) {
+                    shard_ = nullptr;
+                    return;
+                }
+                shard_ = owner_->shards_[index_].get();
+                current_ = shard_->set.begin();
+            }
+        }
+
+        const ShardedSet *owner_ = nullptr;
+        const Shard *shard_ = nullptr;
+        size_t index_ = 0;
+        typename Set<T>::const_iterator current_;
+    };
+
+    explicit ShardedSet(size_t shard_count, size_t rebalance_threshold = 4096)
+            : pivots_(nullptr), threshold_(rebalance_threshold),
+              check_interval_(std::max<size_t>(rebalance_threshold / 16, 1)) {
+        versions_.emplace_back(new Pivots());
+        pivots_.store(versions_.back().get());
+        for (size_t i = 0; i < std::max<size_t>(shard_count, 1); ++i) {
+            shards_.emplace_back(new Shard());
+        }
+    }
+
+    ShardedSet(const ShardedSet &) = delete;
+
+    ShardedSet &operator=(const ShardedSet &) = delete;
+
+    ~ShardedSet() = default;
+
+    // Exact while no rebalance runs; one that is moving keys between shards can make a
+    // concurrent call count them twice or not at all.
+    size_t size() const {
+        size_t total = 0;
+        for (const auto &shard: shards_) {
+            total += shard->size.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t shard_count() const {
+        return shards_.size();
+    }
+
+    void insert(const T &element) {
+        size_t index, shard_size;
+        {
+            std::unique_lock<std::mutex> guard;
+            index = lock_owner(element, guard);
+            Set<T> &set = shards_[index]->set;
+            size_t before = set.size();
+            set.insert(element);
+            if (set.size() == before) {
+                return;
+            }
+            shard_size = set.size();
+            shards_[index]->size.store(shard_size, std::memory_order_relaxed);
+        }
+        if (overloaded(index, shard_size)) {
+            rebalance(index);
+        }
+    }
+
+    void erase(const T &element) {
+        std::unique_lock<std::mutex> guard;
+        Shard &shard = *shards_[lock_owner(element, guard)];
+        shard.set.erase(element);
+        shard.size.store(shard.set.size(), std::memory_order_relaxed);
+    }
+
+    bool contains(const T &element) const {
+        std::unique_lock<std::mutex> guard;
+        const Set<T> &set = shards_[lock_owner(element, guard)]->set;
+        return set.find(element) != set.end();
+    }
+
+    iterator begin() const {
+        return iterator(this, 0, shards_[0]->set.begin());
+    }
+
+    iterator end() const {
+        return iterator();
+    }
+
+    iterator lower_bound(const T &element) const {
+        size_t index = route(element);
+        return iterator(this, index, shards_[index]->set.lower_bound(element));
+    }
+};
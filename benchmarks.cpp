@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "Code.h"
+#include "ShardedSet.h"
+
+// Measures how ShardedSet ingest scales with the number of writer threads: the same random keys
+// are inserted by 1, 2, 4, ... writers, each taking an equal slice, into a set with one shard per
+// writer, next to a single Set behind one mutex as the baseline. Prints keys per second.
+
+template<class Insert>
+static double ingest(const std::vector<int> &keys, size_t writers, Insert insert) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    size_t slice = keys.size() / writers;
+    for (size_t w = 0; w < writers; ++w) {
+        threads.emplace_back([&keys, &insert, slice, w]() {
+            for (size_t i = w * slice; i < (w + 1) * slice; ++i) {
+                insert(keys[i]);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return (slice * writers) / elapsed.count();
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 4000000;
+    size_t max_writers = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    std::mt19937 random(1);
+    std::vector<int> keys(count);
+    for (int &key: keys) {
+        key = static_cast<int>(random());
+    }
+    std::printf("%zu keys, %zu hardware threads\n", count, max_writers);
+    std::printf("writers  sharded keys/s  speedup  mutex keys/s\n");
+    double single = 0;
+    for (size_t writers = 1; writers <= std::max<size_t>(max_writers, 8); writers *= 2) {
+        ShardedSet<int> sharded(writers);
+        double rate = ingest(keys, writers, [&sharded](int key) {
+            sharded.insert(key);
+        });
+        Set<int> locked;
+        std::mutex mutex;
+        double baseline = ingest(keys, writers, [&locked, &mutex](int key) {
+            std::lock_guard<std::mutex> guard(mutex);
+            locked.insert(key);
+        });
+        if (writers == 1) {
+            single = rate;
+        }
+        std::printf("%7zu  %14.0f  %7.2f  %12.0f\n", writers, rate, rate / single, baseline);
+    }
+}
@@ -0,0 +1,822 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Code.h"
+#include "LoggedSet.h"
+#include "MappedSet.h"
+#include "PagedSet.h"
+#include "ShardedSet.h"
+
+// Behavioural checks for the containers in this repository, one function per feature: the
+// in-memory Set, Map and Multiset, round trips through every on-disk and in-memory image of a
+// set, log replay after a torn write, and concurrent ingest into a ShardedSet. Files are created
+// in the working directory and removed afterwards. Exits with the number of failed checks.
+
+static int failures = 0;
+
+static void check(bool ok, const char *condition, int line) {
+    if (!ok) {
+        std::fprintf(stderr, "tests.cpp:%d: check failed: %s\n", line, condition);
+        failures++;
+    }
+}
+
+#define CHECK(condition) check(static_cast<bool>(condition), #condition, __LINE__)
+
+static std::vector<int> random_keys(size_t count, unsigned seed) {
+    std::mt19937 random(seed);
+    std::vector<int> keys(count);
+    for (int &key: keys) {
+        key = static_cast<int>(random() % (4 * count + 1));
+    }
+    return keys;
+}
+
+template<class Left, class Right>
+static bool same_keys(const Left &left, const Right &right) {
+    return std::equal(left.begin(), left.end(), right.begin(), right.end());
+}
+
+static long file_size(const std::string &path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    return in ? static_cast<long>(in.tellg()) : -1;
+}
+
+static void test_set_against_reference() {
+    std::mt19937 random(1);
+    Set<int> set;
+    std::set<int> reference;
+    for (int i = 0; i < 200000; ++i) {
+        int key = static_cast<int>(random() % 5000);
+        if (random() % 3 == 0) {
+            set.erase(key);
+            reference.erase(key);
+        } else {
+            set.insert(key);
+            reference.insert(key);
+        }
+    }
+    CHECK(set.size() == reference.size());
+    CHECK(same_keys(set, reference));
+    CHECK(set.erase_range(1000, 2000) == static_cast<size_t>(std::distance(reference.lower_bound(1000),
+                                                                           reference.lower_bound(2000))));
+    reference.erase(reference.lower_bound(1000), reference.lower_bound(2000));
+    CHECK(same_keys(set, reference));
+
+    Set<int> right = set.split_off(3000);
+    CHECK(same_keys(set, std::set<int>(reference.begin(), reference.lower_bound(3000))));
+    set.join(right);
+    CHECK(same_keys(set, reference));
+}
+
+static void test_iterators_survive_moves() {
+    Set<int> set;
+    for (int i = 0; i < 10000; ++i) {
+        set.insert(2 * i);
+    }
+    Set<int>::const_iterator it = set.find(500);
+    Set<int> moved(std::move(set));
+    CHECK(*it == 500 && *++it == 502);
+    Set<int> swapped;
+    swapped.swap(moved);
+    CHECK(*++it == 504);
+    Set<int> small{-3, -1};
+    small.join(swapped);
+    CHECK(*++it == 506 && small.size() == 10002);
+
+    Map<int, int> map;
+    int &value = map[10];
+    for (int i = 0; i < 1000; ++i) {
+        map[i] = i;
+    }
+    value = -1;
+    CHECK(map.at(10) == -1);
+}
+
+static void test_serialize_round_trip() {
+    for (size_t count: {0, 3, 100000}) {
+        Set<int> set;
+        for (int key: random_keys(count, 2)) {
+            set.insert(key);
+        }
+        std::stringstream image;
+        set.serialize(image);
+        Set<int> loaded = Set<int>::deserialize(image);
+        CHECK(loaded.size() == set.size());
+        CHECK(same_keys(loaded, set));
+
+        const std::string path = "tests_checkpoint.bin";
+        set.checkpoint(path).get();
+        std::ifstream in(path, std::ios::binary);
+        CHECK(same_keys(Set<int>::deserialize(in), set));
+        std::remove(path.c_str());
+    }
+
+    std::stringstream full;
+    Set<int>{1, 2, 3}.serialize(full);
+    std::string image = full.str();
+    std::stringstream torn(image.substr(0, image.size() - 1));
+    bool thrown = false;
+    try {
+        Set<int>::deserialize(torn);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+static void test_mapped_round_trip() {
+    const std::string path = "tests_mapped.img";
+    for (size_t count: {0, 1, 5, 100000}) {
+        Set<int> set;
+        for (int key: random_keys(count, 3)) {
+            set.insert(key);
+        }
+        MappedSet<int>::freeze(set, path);
+        MappedSet<int> mapped(path);
+        CHECK(mapped.size() == set.size());
+        CHECK(same_keys(mapped, set));
+        for (int key = -1; key < static_cast<int>(4 * count + 2); key += 7) {
+            CHECK((mapped.find(key) != mapped.end()) == (set.find(key) != set.end()));
+            auto lower = mapped.lower_bound(key);
+            CHECK(lower == mapped.end() ? set.lower_bound(key) == set.end() : *lower == *set.lower_bound(key));
+        }
+    }
+    // Point the root, which freeze writes last, past the nodes: the image still opens, and the
+    // first lookup through the root reports the damage.
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(static_cast<std::streamoff>(file_size(path) - 2 * sizeof(uint64_t) - 2 * sizeof(int)));
+        uint64_t first = uint64_t(1) << 40;
+        file.write(reinterpret_cast<const char *>(&first), sizeof(first));
+    }
+    MappedSet<int> damaged(path);
+    bool thrown = false;
+    try {
+        damaged.find(0);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    CHECK(thrown && damaged.size() > 0);
+    std::remove(path.c_str());
+}
+
+static void test_paged_round_trip() {
+    const std::string path = "tests_paged.db";
+    std::remove(path.c_str());
+    std::set<int> reference;
+    {
+        PagedSet<int> paged(path, 16);
+        std::vector<int> keys = random_keys(50000, 4);
+        for (int key: keys) {
+            paged.insert(key);
+            reference.insert(key);
+        }
+        for (size_t i = 0; i < keys.size(); i += 3) {
+            paged.erase(keys[i]);
+            reference.erase(keys[i]);
+        }
+        CHECK(paged.size() == reference.size());
+        paged.close();
+    }
+    const std::string crashed = "tests_paged_crashed.db";
+    {
+        PagedSet<int> reopened(path, 16);
+        CHECK(reopened.size() == reference.size());
+        CHECK(same_keys(reopened, reference));
+        CHECK(reopened.find(-1) == reopened.end());
+        // A copy taken mid-update is what a crash leaves behind.
+        reopened.insert(-1);
+        std::ifstream in(path, std::ios::binary);
+        std::ofstream out(crashed, std::ios::binary);
+        out << in.rdbuf();
+        reopened.erase(-1);
+    }
+    bool refused = false;
+    try {
+        PagedSet<int> unclean(crashed, 16);
+    } catch (const std::runtime_error &) {
+        refused = true;
+    }
+    CHECK(refused);
+    {
+        PagedSet<int> reopened(path, 16);
+        CHECK(reopened.size() == reference.size());
+    }
+    std::remove(crashed.c_str());
+    std::remove(path.c_str());
+}
+
+static void test_logged_torn_replay() {
+    const std::string checkpoint = "tests_logged.ckpt", log = "tests_logged.log";
+    std::remove(checkpoint.c_str());
+    std::remove(log.c_str());
+    std::set<int> reference;
+    {
+        LoggedSet<int> logged(checkpoint, log, 8);
+        for (int i = 0; i < 100; ++i) {
+            logged.insert(i);
+            reference.insert(i);
+        }
+        for (int i = 0; i < 20; i += 2) {
+            logged.erase(i);
+            reference.erase(i);
+        }
+        logged.close();
+    }
+    long intact = file_size(log);
+    {
+        // A record cut off in the middle of its key, as a crash during the write leaves it.
+        std::ofstream out(log, std::ios::binary | std::ios::app);
+        out.put('+');
+        out.write("\x01\x02", 2);
+    }
+    {
+        LoggedSet<int> logged(checkpoint, log, 8);
+        CHECK(same_keys(logged.set(), reference));
+        CHECK(file_size(log) == intact);
+        logged.checkpoint();
+        CHECK(file_size(log) == 0);
+        logged.insert(1000);
+        reference.insert(1000);
+    }
+    {
+        LoggedSet<int> logged(checkpoint, log, 8);
+        CHECK(same_keys(logged.set(), reference));
+    }
+    std::remove(checkpoint.c_str());
+    std::remove(log.c_str());
+}
+
+static void test_sharded_ingest() {
+    const size_t writers = 8, per_writer = 50000;
+    ShardedSet<int> sharded(writers, 1024);
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < writers; ++w) {
+        threads.emplace_back([&sharded, w]() {
+            for (size_t i = 0; i < per_writer; ++i) {
+                // Writers interleave over the whole key range, and every key is inserted twice.
+                sharded.insert(static_cast<int>(((i / 2) * writers + w) * 3));
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    std::vector<int> expected;
+    for (size_t i = 0; i < writers * per_writer / 2; ++i) {
+        expected.push_back(static_cast<int>(i * 3));
+    }
+    CHECK(sharded.size() == expected.size());
+    CHECK(same_keys(sharded, expected));
+    CHECK(sharded.contains(3) && !sharded.contains(4));
+    CHECK(*sharded.lower_bound(4) == 6);
+    CHECK(sharded.lower_bound(static_cast<int>(3 * expected.size())) == sharded.end());
+}
+
+static void test_map_emplace() {
+    Map<int, std::string> map;
+    auto inserted = map.try_emplace(5, 3, 'x');
+    CHECK(inserted.second && inserted.first->second == "xxx");
+    auto kept = map.try_emplace(5, "ignored");
+    CHECK(!kept.second && kept.first->second == "xxx" && map.size() == 1);
+
+    auto assigned = map.insert_or_assign(5, "y");
+    CHECK(!assigned.second && map.at(5) == "y");
+    auto added = map.insert_or_assign(7, "z");
+    CHECK(added.second && added.first->first == 7 && map.at(7) == "z");
+
+    auto hinted = map.try_emplace(map.find(7), 6, "w");
+    CHECK(hinted->first == 6 && map.size() == 3);
+    CHECK(map.try_emplace(map.end(), 6, "v")->second == "w");
+
+    for (int i = 100; i < 2000; ++i) {
+        map.try_emplace(i, std::to_string(i));
+    }
+    bool all = true;
+    for (int i = 100; i < 2000; ++i) {
+        all = all && map.at(i) == std::to_string(i);
+    }
+    CHECK(all && map.size() == 1903);
+}
+
+static void test_multiset() {
+    Multiset<int> multiset{3, 1, 3, 2, 3};
+    CHECK(multiset.size() == 5 && multiset.distinct_size() == 3);
+    CHECK(multiset.count(3) == 3 && multiset.count(4) == 0);
+    CHECK(multiset.count(multiset.find(1)) == 1);
+    multiset.insert(2, 4);
+    CHECK(multiset.count(2) == 5 && multiset.size() == 9);
+    CHECK(multiset.insert(9, 0) == multiset.end() && multiset.size() == 9);
+
+    CHECK(multiset.erase_one(3) == 2 && multiset.size() == 8);
+    CHECK(multiset.erase_one(1) == 0 && multiset.distinct_size() == 2);
+    CHECK(multiset.erase_one(1) == 0 && multiset.size() == 7);
+    CHECK(multiset.erase_all(2) == 5 && multiset.size() == 2 && multiset.count(2) == 0);
+    CHECK(multiset.erase_all(2) == 0);
+
+    for (int i = 0; i < 3000; ++i) {
+        multiset.insert(i % 500);
+    }
+    CHECK(multiset.size() == 3002 && multiset.distinct_size() == 500 && multiset.count(3) == 8);
+
+    Multiset<int> moved(std::move(multiset));
+    CHECK(moved.size() == 3002 && multiset.size() == 0 && multiset.empty());
+    Multiset<int> assigned{7};
+    assigned = std::move(moved);
+    CHECK(assigned.size() == 3002 && moved.size() == 1 && moved.distinct_size() == 1);
+    Multiset<int> copy(assigned);
+    copy.clear();
+    CHECK(copy.size() == 0 && copy.distinct_size() == 0 && assigned.size() == 3002);
+}
+
+static void test_bidirectional_surface() {
+    Set<int> set;
+    for (int i = 0; i < 5000; ++i) {
+        set.insert(2 * i);
+    }
+    CHECK(*set.upper_bound(10) == 12 && *set.upper_bound(11) == 12);
+    CHECK(set.upper_bound(9998) == set.end());
+    auto range = set.equal_range(10);
+    CHECK(*range.first == 10 && *range.second == 12);
+    range = set.equal_range(11);
+    CHECK(range.first == range.second && *range.first == 12);
+    std::vector<int> backwards(set.rbegin(), set.rend());
+    CHECK(backwards.size() == 5000 && backwards.front() == 9998 && backwards.back() == 0);
+    CHECK(std::is_sorted(backwards.rbegin(), backwards.rend()));
+    auto last = set.end();
+    CHECK(*--last == 9998 && *--last == 9996);
+
+    Map<int, int> map{{1, 10}, {2, 20}, {3, 30}};
+    static_assert(std::is_same<std::iterator_traits<Map<int, int>::iterator>::reference,
+                               std::pair<const int, int> &>::value, "Map references are real references");
+    for (auto &entry: map) {
+        entry.second++;
+    }
+    CHECK(map.at(1) == 11 && map.at(2) == 21 && map.at(3) == 31);
+    std::pair<const int, int> *entry = &*map.find(2);
+    for (int i = 4; i < 1000; ++i) {
+        map[i] = i;
+    }
+    CHECK(entry->first == 2 && entry->second == 21);
+    CHECK(std::prev(map.end())->first == 999 && map.rbegin()->second == 999);
+    CHECK(map.upper_bound(2)->first == 3 && map.equal_range(5).first->second == 5);
+}
+
+static void test_hinted_insert_and_find_near() {
+    std::mt19937 rng(30);
+    Set<int> set;
+    std::set<int> reference;
+    auto hint = set.end();
+    for (int i = 0; i < 20000; ++i) {
+        int key = static_cast<int>(rng() % 50000);
+        // Alternate between a good hint, a stale one and end() so every climb distance is covered.
+        if (i % 3 == 2) {
+            hint = set.end();
+        }
+        auto placed = set.insert(hint, key);
+        CHECK(*placed == key);
+        reference.insert(key);
+        hint = i % 3 == 0 ? placed : set.begin();
+    }
+    CHECK(set.size() == reference.size());
+    CHECK(std::equal(set.begin(), set.end(), reference.begin()));
+    auto duplicate = set.insert(set.begin(), *reference.rbegin());
+    CHECK(duplicate == std::prev(set.end()) && set.size() == reference.size());
+
+    auto from = set.find(*reference.begin());
+    for (int i = 0; i < 2000; ++i) {
+        int key = static_cast<int>(rng() % 50000);
+        auto near = set.find_near(from, key);
+        CHECK((near == set.end()) == (reference.count(key) == 0));
+        if (near != set.end()) {
+            CHECK(*near == key);
+            from = near;
+        }
+    }
+    CHECK(set.find_near(set.end(), *reference.begin()) == set.begin());
+
+    Map<int, int> map;
+    auto at = map.end();
+    for (int i = 0; i < 1000; ++i) {
+        at = map.try_emplace(at, i, i * 3);
+    }
+    CHECK(map.size() == 1000 && map.find_near(map.begin(), 999)->second == 2997);
+    CHECK(map.try_emplace(map.begin(), 500, -1)->second == 1500);
+}
+
+static void test_push_back_sorted() {
+    Set<int> set;
+    for (int i = 0; i < 30000; ++i) {
+        auto appended = set.push_back_sorted(3 * i);
+        CHECK(*appended == 3 * i && std::next(appended) == set.end());
+    }
+    CHECK(set.size() == 30000 && *set.rbegin() == 3 * 29999);
+    int expected = 0;
+    bool ordered = true;
+    for (int key: set) {
+        ordered = ordered && key == expected;
+        expected += 3;
+    }
+    CHECK(ordered);
+    // The appended tree takes ordinary updates afterwards.
+    set.insert(1);
+    set.erase(0);
+    CHECK(set.find(3 * 15000) != set.end() && *set.begin() == 1);
+    set.push_back_sorted(1 << 30);
+    CHECK(*std::prev(set.end()) == 1 << 30 && set.size() == 30001);
+
+    Map<int, std::string> map;
+    for (int i = 0; i < 500; ++i) {
+        map.push_back_sorted(i, std::to_string(i));
+    }
+    CHECK(map.size() == 500 && map.at(250) == "250" && map.rbegin()->second == "499");
+}
+
+static void test_checkpoint_while_writing() {
+    const std::string path = "tests_checkpoint_live.bin";
+    std::mt19937 rng(35);
+    Set<int> set;
+    for (int key: random_keys(200000, 35)) {
+        set.insert(key);
+    }
+    Set<int> expected(set);
+    std::future<void> done = set.checkpoint(path);
+    // Every kind of leaf change races the writer: inserts and erases that split and merge
+    // leaves, range erasure, erase_if, a split and join, and finally dropping the tree.
+    for (int i = 0; i < 20000; ++i) {
+        set.insert(static_cast<int>(rng() % 1000000));
+        set.erase(static_cast<int>(rng() % 1000000));
+    }
+    set.erase_range(100000, 200000);
+    set.erase_if([](int key) { return key % 3 == 0; });
+    Set<int> right = set.split_off(500000);
+    set.join(right);
+    set.clear();
+    done.get();
+    std::ifstream in(path, std::ios::binary);
+    CHECK(same_keys(Set<int>::deserialize(in), expected));
+    std::remove(path.c_str());
+
+    // Two checkpoints in flight at once see the tree at their own start.
+    Set<int> twice{1, 2, 3};
+    for (int i = 10; i < 50000; ++i) {
+        twice.insert(i);
+    }
+    Set<int> first_state(twice);
+    std::future<void> first = twice.checkpoint(path + ".1");
+    twice.erase_range(10, 30000);
+    Set<int> second_state(twice);
+    std::future<void> second = twice.checkpoint(path + ".2");
+    twice.insert(-1);
+    first.get();
+    second.get();
+    std::ifstream first_in(path + ".1", std::ios::binary), second_in(path + ".2", std::ios::binary);
+    CHECK(same_keys(Set<int>::deserialize(first_in), first_state));
+    CHECK(same_keys(Set<int>::deserialize(second_in), second_state));
+    std::remove((path + ".1").c_str());
+    std::remove((path + ".2").c_str());
+}
+
+static void test_erase_if_paths() {
+    std::vector<int> keys = random_keys(100000, 39);
+    // Few removals take the per-leaf path and most take the rebuild; both with one and several
+    // threads evaluating the predicate.
+    for (int modulus: {97, 2}) {
+        for (size_t threads: {1, 4}) {
+            Set<int> set;
+            std::set<int> reference;
+            for (int key: keys) {
+                set.insert(key);
+                reference.insert(key);
+            }
+            auto doomed = [modulus](int key) { return key % modulus != 1; };
+            auto rare = [modulus](int key) { return key % modulus == 1; };
+            size_t erased = modulus == 2 ? set.erase_if(doomed, 0.1, threads) : set.erase_if(rare, 0.1, threads);
+            size_t expected = 0;
+            for (auto it = reference.begin(); it != reference.end();) {
+                if (modulus == 2 ? doomed(*it) : rare(*it)) {
+                    it = reference.erase(it);
+                    expected++;
+                } else {
+                    ++it;
+                }
+            }
+            CHECK(erased == expected && set.size() == reference.size());
+            CHECK(same_keys(set, reference));
+            set.insert(-5);
+            CHECK(set.find(-5) != set.end() && *set.begin() == -5);
+        }
+    }
+
+    Map<int, int> map;
+    for (int i = 0; i < 10000; ++i) {
+        map[i] = i % 10;
+    }
+    size_t erased = map.erase_if([](const std::pair<const int, int> &entry) { return entry.second != 0; }, 0.1, 3);
+    CHECK(erased == 9000 && map.size() == 1000 && map.begin()->first == 0 && map.rbegin()->first == 9990);
+    CHECK(erase_if(map, [](const std::pair<const int, int> &) { return true; }) == 1000 && map.empty());
+}
+
+static void test_set_without_parent_links() {
+    std::mt19937 rng(42);
+    Set<int, false> set;
+    std::set<int> reference;
+    // Enough keys for several levels of branches, so climbs go past the leaf's own parent.
+    for (int key: random_keys(150000, 42)) {
+        set.insert(key);
+        reference.insert(key);
+    }
+    CHECK(same_keys(set, reference));
+    for (int i = 0; i < 20000; ++i) {
+        int key = static_cast<int>(rng() % 600000);
+        switch (i % 4) {
+            case 0:
+                set.erase(key);
+                reference.erase(key);
+                break;
+            case 1: {
+                auto hint = set.lower_bound(key + 50);
+                CHECK(*set.insert(hint, key) == key);
+                reference.insert(key);
+                break;
+            }
+            case 2: {
+                auto found = set.lower_bound(key);
+                auto expected = reference.lower_bound(key);
+                CHECK((found == set.end()) == (expected == reference.end()));
+                if (found != set.end()) {
+                    auto next = set.erase(found);
+                    expected = reference.erase(expected);
+                    CHECK((next == set.end()) == (expected == reference.end()));
+                    CHECK(next == set.end() || *next == *expected);
+                }
+                break;
+            }
+            default: {
+                auto near = set.find_near(set.begin(), key);
+                CHECK((near == set.end()) == (reference.count(key) == 0));
+                break;
+            }
+        }
+    }
+    CHECK(set.size() == reference.size() && same_keys(set, reference));
+    CHECK(std::equal(set.rbegin(), set.rend(), reference.rbegin(), reference.rend()));
+
+    CHECK(set.erase_range(100000, 250000) == static_cast<size_t>(std::distance(
+            reference.lower_bound(100000), reference.lower_bound(250000))));
+    reference.erase(reference.lower_bound(100000), reference.lower_bound(250000));
+    size_t erased = erase_if(set, [](int key) { return key % 101 == 0; });
+    size_t expected = 0;
+    for (auto it = reference.begin(); it != reference.end();) {
+        if (*it % 101 == 0) {
+            it = reference.erase(it);
+            expected++;
+        } else {
+            ++it;
+        }
+    }
+    CHECK(erased == expected && same_keys(set, reference));
+
+    Set<int, false> right = set.split_off(400000);
+    CHECK(right.size() == static_cast<size_t>(std::distance(reference.lower_bound(400000), reference.end())));
+    CHECK(*right.begin() == *reference.lower_bound(400000) && *std::prev(set.end()) < 400000);
+    set.join(right);
+    CHECK(same_keys(set, reference));
+
+    // Draining through erase(iterator) walks every leaf underflow and merge.
+    for (auto it = set.begin(); it != set.end();) {
+        it = set.erase(it);
+    }
+    CHECK(set.empty());
+    for (int i = 0; i < 10000; ++i) {
+        set.push_back_sorted(i);
+    }
+    std::stringstream image;
+    set.serialize(image);
+    Set<int, false> loaded = Set<int, false>::deserialize(image);
+    CHECK(loaded.size() == 10000 && *std::prev(loaded.end()) == 9999);
+    loaded.erase(5000);
+    CHECK(loaded.find(5001) != loaded.end() && *std::prev(loaded.find(5001)) == 4999);
+}
+
+static void test_frozen_set() {
+    // Sizes around powers of two change which levels of the implicit tree are full.
+    for (size_t count: {0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 1000, 65537}) {
+        std::set<int> reference;
+        for (size_t i = 0; i < count; ++i) {
+            reference.insert(static_cast<int>(3 * i + 1));
+        }
+        Set<int> set(reference.begin(), reference.end());
+        FrozenSet<int> frozen = set.freeze();
+        CHECK(frozen.size() == count && frozen.empty() == (count == 0));
+        CHECK(same_keys(frozen, reference));
+        CHECK(std::equal(std::reverse_iterator<FrozenSet<int>::const_iterator>(frozen.end()),
+                         std::reverse_iterator<FrozenSet<int>::const_iterator>(frozen.begin()),
+                         reference.rbegin(), reference.rend()));
+        // Every key, every gap between keys and both ends.
+        bool agree = true;
+        for (int key = -1; key <= static_cast<int>(3 * count + 2); ++key) {
+            auto lower = frozen.lower_bound(key), upper = frozen.upper_bound(key), found = frozen.find(key);
+            auto expected_lower = reference.lower_bound(key), expected_upper = reference.upper_bound(key);
+            agree = agree && (lower == frozen.end()) == (expected_lower == reference.end()) &&
+                    (lower == frozen.end() || *lower == *expected_lower);
+            agree = agree && (upper == frozen.end()) == (expected_upper == reference.end()) &&
+                    (upper == frozen.end() || *upper == *expected_upper);
+            agree = agree && (found == frozen.end()) == (reference.count(key) == 0) &&
+                    (found == frozen.end() || *found == key);
+        }
+        CHECK(agree);
+    }
+
+    FrozenSet<double> empty;
+    CHECK(empty.empty() && empty.begin() == empty.end() && empty.find(1.0) == empty.end());
+    std::vector<double> halves;
+    for (int i = 0; i < 5000; ++i) {
+        halves.push_back(i / 2.0);
+    }
+    FrozenSet<double> frozen(halves.begin(), halves.end());
+    CHECK(*frozen.lower_bound(10.25) == 10.5 && *frozen.upper_bound(10.5) == 11.0);
+    CHECK(frozen.find(10.25) == frozen.end() && *--frozen.end() == 2499.5);
+    CHECK(frozen.lower_bound(2499.75) == frozen.end() && frozen.lower_bound(-1.0) == frozen.begin());
+}
+
+// Keys are spread over negative and positive values with gaps between them, and probes land on
+// keys, in the gaps and past both ends.
+template<class T>
+static void check_vector_scan_set(unsigned seed) {
+    std::mt19937 rng(seed);
+    Set<T> set;
+    std::set<T> reference;
+    for (int i = 0; i < 20000; ++i) {
+        T key = static_cast<T>(static_cast<int64_t>(rng() % 200000) - 100000) * static_cast<T>(4);
+        set.insert(key);
+        reference.insert(key);
+    }
+    CHECK(same_keys(set, reference));
+    bool agree = true;
+    for (int i = 0; i < 20000; ++i) {
+        T probe = static_cast<T>(static_cast<int64_t>(rng() % 900000) - 450000);
+        auto lower = set.lower_bound(probe);
+        auto expected = reference.lower_bound(probe);
+        agree = agree && (lower == set.end()) == (expected == reference.end()) &&
+                (lower == set.end() || *lower == *expected);
+        auto found = set.find(probe);
+        agree = agree && (found == set.end()) == (reference.count(probe) == 0);
+    }
+    CHECK(agree);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// count_less only ever runs the widest kernel the CPU has, so the narrower ones are called
+// directly, on every length up to a full leaf so each partial vector at the end is counted.
+template<class T>
+static void check_vector_kernels() {
+    using Scan = LeafScan<T>;
+    std::vector<T> keys;
+    for (int i = 0; i < 300; ++i) {
+        keys.push_back(static_cast<T>(2 * i - 300));
+    }
+    bool agree = true;
+    for (size_t count = 0; count <= keys.size(); count += count < 40 ? 1 : 37) {
+        for (int probe = -302; probe <= 302; probe += 3) {
+            size_t expected = Scan::scalar(keys.data(), count, static_cast<T>(probe));
+            agree = agree && Scan::count_less(keys.data(), count, static_cast<T>(probe)) == expected;
+            if (__builtin_cpu_supports("avx512f")) {
+                agree = agree && Scan::avx512(keys.data(), count, static_cast<T>(probe)) == expected;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                agree = agree && Scan::avx2(keys.data(), count, static_cast<T>(probe)) == expected;
+            }
+            if (__builtin_cpu_supports("sse4.2")) {
+                agree = agree && Scan::sse(keys.data(), count, static_cast<T>(probe)) == expected;
+            }
+        }
+    }
+    CHECK(agree);
+}
+#endif
+
+static void test_vector_leaf_scan() {
+    check_vector_scan_set<int32_t>(46);
+    check_vector_scan_set<int64_t>(47);
+    check_vector_scan_set<float>(48);
+    check_vector_scan_set<double>(49);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    check_vector_kernels<int32_t>();
+    check_vector_kernels<int64_t>();
+    check_vector_kernels<float>();
+    check_vector_kernels<double>();
+#endif
+    // Keys beyond 32 bits, which a kernel comparing the wrong lane width would mix up.
+    Set<int64_t> wide;
+    for (int64_t i = 0; i < 5000; ++i) {
+        wide.insert((i << 33) - (int64_t(1) << 40));
+    }
+    CHECK(*wide.lower_bound(1) == int64_t(1) << 33 && wide.find(int64_t(3) << 33) != wide.end());
+    CHECK(wide.find((int64_t(3) << 33) + 1) == wide.end() && *wide.lower_bound(-(int64_t(1) << 40)) == -(int64_t(1) << 40));
+}
+
+static void test_clear_and_reuse() {
+    // Inline, one leaf and a deep tree each drop everything and then take new keys.
+    for (int count: {3, 40, 100000}) {
+        Set<int> set;
+        for (int i = 0; i < count; ++i) {
+            set.insert(i);
+        }
+        set.clear();
+        CHECK(set.empty() && set.size() == 0 && set.begin() == set.end());
+        CHECK(set.find(0) == set.end() && set.lower_bound(-1) == set.end());
+        set.clear();
+        CHECK(set.empty());
+        std::set<int> reference;
+        for (int key: random_keys(static_cast<size_t>(count), 50)) {
+            set.insert(key);
+            reference.insert(key);
+        }
+        CHECK(set.size() == reference.size() && same_keys(set, reference));
+        set.erase(*reference.begin());
+        reference.erase(reference.begin());
+        CHECK(same_keys(set, reference));
+    }
+
+    Set<int, false> unlinked{5, 1, 3};
+    for (int i = 10; i < 5000; ++i) {
+        unlinked.insert(i);
+    }
+    unlinked.clear();
+    unlinked.insert(7);
+    CHECK(unlinked.size() == 1 && *unlinked.begin() == 7);
+
+    // Entries own heap memory, so the sanitizer builds catch a leak or a double free here.
+    Map<std::string, std::string> map;
+    for (int i = 0; i < 3000; ++i) {
+        map[std::to_string(i)] = std::string(40, 'v');
+    }
+    map.clear();
+    CHECK(map.empty() && map.find("1") == map.end() && map.begin() == map.end());
+    map["again"] = "yes";
+    map.insert_or_assign("again", "still");
+    CHECK(map.size() == 1 && map.at("again") == "still");
+
+    Multiset<int> multiset;
+    for (int i = 0; i < 2000; ++i) {
+        multiset.insert(i % 100, 2);
+    }
+    multiset.clear();
+    CHECK(multiset.size() == 0 && multiset.distinct_size() == 0 && multiset.count(5) == 0);
+    multiset.insert(5, 3);
+    multiset.insert(5);
+    CHECK(multiset.size() == 4 && multiset.distinct_size() == 1 && multiset.count(5) == 4);
+
+    // A checkpoint in flight still writes the keys it started with when the set is cleared.
+    const std::string path = "tests_clear_checkpoint.bin";
+    Set<int> pinned;
+    for (int i = 0; i < 50000; ++i) {
+        pinned.insert(i);
+    }
+    std::future<void> done = pinned.checkpoint(path);
+    pinned.clear();
+    pinned.insert(-1);
+    done.get();
+    std::ifstream in(path, std::ios::binary);
+    Set<int> written = Set<int>::deserialize(in);
+    CHECK(written.size() == 50000 && *written.begin() == 0 && pinned.size() == 1);
+    std::remove(path.c_str());
+}
+
+int main() {
+    test_set_against_reference();
+    test_iterators_survive_moves();
+    test_serialize_round_trip();
+    test_mapped_round_trip();
+    test_paged_round_trip();
+    test_logged_torn_replay();
+    test_sharded_ingest();
+    test_map_emplace();
+    test_multiset();
+    test_bidirectional_surface();
+    test_hinted_insert_and_find_near();
+    test_push_back_sorted();
+    test_checkpoint_while_writing();
+    test_erase_if_paths();
+    test_set_without_parent_links();
+    test_frozen_set();
+    test_vector_leaf_scan();
+    test_clear_and_reuse();
+    if (failures == 0) {
+        std::printf("all tests passed\n");
+    }
+    return failures;
+}